@@ -0,0 +1,339 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+heap_t arenas[ARENA_COUNT_MAX];
+unsigned int arena_nr;
+unsigned int arena_next;
+pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread heap_t *thread_arena;
+
+/**
+ * Reserves size bytes of address space for heap, without committing
+ * any memory. The heap then grows inside this range.
+ * @return 1 for success, 0 otherwise.
+ */
+int vm_heap_reserve(heap_t *heap, size_t size)
+{
+	char *base = mmap(NULL, size, PROT_NONE,
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (base == MAP_FAILED)
+		return 0;
+
+	STATS_ADD(nmmap, 1);
+
+	heap->base = base;
+	heap->end = base;
+	heap->commit_end = base;
+	heap->reserve_end = base + size;
+
+	// Without its bitmap, the heap is searched through its list.
+	if (conf.start_map)
+		start_map_create(heap);
+
+	return 1;
+}
+
+/**
+ * Grows a reserved heap by increment bytes, committing the pages
+ * it reaches with mprotect().
+ * @return the previous end of the heap, or (void *) -1 on failure.
+ */
+void *vm_heap_grow(heap_t *heap, size_t increment)
+{
+	if (increment > (size_t)(heap->reserve_end - heap->end))
+		return (void *) -1;
+
+	size_t page_size = getpagesize();
+	char *new_end = heap->end + increment;
+	char *new_commit_end = (char *)(((uintptr_t)new_end + page_size - 1) & ~(page_size - 1));
+
+	if (new_commit_end > heap->commit_end) {
+		if (mprotect(heap->commit_end, new_commit_end - heap->commit_end,
+					 PROT_READ | PROT_WRITE) != 0)
+			return (void *) -1;
+
+		heap->commit_end = new_commit_end;
+	}
+
+	STATS_ADD(heap_size, increment);
+
+	char *old_end = heap->end;
+
+	heap->end = new_end;
+	return old_end;
+}
+
+/**
+ * Shrinks a reserved heap by decrement bytes. The pages above the new
+ * end are replaced by a fresh PROT_NONE mapping, which drops them.
+ * @return 1 for success.
+ */
+int vm_heap_shrink(heap_t *heap, size_t decrement)
+{
+	size_t page_size = getpagesize();
+	char *new_end = heap->end - decrement;
+	char *new_commit_end = (char *)(((uintptr_t)new_end + page_size - 1) & ~(page_size - 1));
+
+	if (new_commit_end < heap->commit_end) {
+		void *ret = mmap(new_commit_end, heap->commit_end - new_commit_end, PROT_NONE,
+						 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+		DIE(ret == MAP_FAILED, "Critical error: mmap() failed.\n");
+
+		heap->commit_end = new_commit_end;
+	}
+
+	STATS_SUB(heap_size, decrement);
+
+	heap->end = new_end;
+	return 1;
+}
+
+/**
+ * Initializes arena idx, reserving its address space.
+ * @return the arena, or NULL if its range could not be reserved.
+ */
+heap_t *arena_create(unsigned int idx)
+{
+	heap_t *arena = &arenas[idx];
+
+	if (idx == 0)
+		return main_heap;
+
+	pthread_mutex_lock(&arena_lock);
+
+	if (!arena->base) {
+		heap_init(arena, idx);
+
+		if (!vm_heap_reserve(arena, ARENA_RESERVE_SIZE)) {
+			pthread_mutex_unlock(&arena_lock);
+			return NULL;
+		}
+
+		if (idx >= arena_nr)
+			__atomic_store_n(&arena_nr, idx + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&arena_lock);
+
+	return arena;
+}
+
+/**
+ * Returns the arena of the calling thread. Threads are bound to the
+ * arenas round-robin on their first allocation; the first thread to
+ * allocate gets the main heap.
+ */
+heap_t *arena_get(void)
+{
+	if (thread_arena)
+		return thread_arena;
+
+	if (conf.arena_count == 1)
+		return main_heap;
+
+	unsigned int idx = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+
+	thread_arena = arena_create(idx % conf.arena_count);
+	if (!thread_arena)
+		thread_arena = main_heap;
+
+	return thread_arena;
+}
+
+/**
+ * A heap whose reserved range is used up maps the blocks it has no room
+ * for, except for the arenas, which hand them to the main heap instead,
+ * as mapping every small block would cost a page and a system call each.
+ * @return 1 if heap maps such blocks, 0 otherwise.
+ */
+int heap_maps_overflow(heap_t *heap)
+{
+	return heap->base && (heap == main_heap || heap->id == HEAP_ID_USER);
+}
+
+/**
+ * Moves the block ptr of arena, which has no room left to resize it,
+ * to a block of size bytes of the main heap. Only one heap lock is held
+ * at a time.
+ * @return the new payload, or NULL on failure.
+ */
+void *arena_overflow_realloc(heap_t *arena, void *ptr, size_t size)
+{
+	heap_lock(arena);
+	block_meta_t *block = search_block_in_list(arena, ptr);
+	size_t old_size = (block && (block->status == STATUS_ALLOC ||
+								 block->status == STATUS_MAPPED)) ? block->size : 0;
+
+	heap_unlock(arena);
+
+	if (!old_size)
+		return NULL;
+
+	heap_lock(main_heap);
+	void *result = heap_malloc(main_heap, size);
+
+	heap_unlock(main_heap);
+
+	if (!result)
+		return NULL;
+
+	bulk_copy(result, ptr, old_size < size ? old_size : size);
+
+	heap_lock(arena);
+	heap_free(arena, ptr);
+	heap_unlock(arena);
+
+	return result;
+}
+
+/**
+ * Returns the arena of the calling thread without binding it to one.
+ * @return the arena, or NULL if the thread has not allocated yet.
+ */
+heap_t *arena_current(void)
+{
+	if (thread_arena)
+		return thread_arena;
+
+	if (conf.arena_count == 1)
+		return main_heap;
+
+	return NULL;
+}
+
+/**
+ * Finds the heap that owns the payload ptr. With a single arena this
+ * is always the main heap, otherwise the owner is read from the block.
+ */
+heap_t *heap_of_block(void *ptr)
+{
+	unsigned int nr = __atomic_load_n(&arena_nr, __ATOMIC_ACQUIRE);
+
+	if (nr <= 1)
+		return main_heap;
+
+	block_meta_t *block = (block_meta_t *)((char *)ptr - META_BLOCK_SIZE);
+
+	if (block->arena < nr && arenas[block->arena].base)
+		return &arenas[block->arena];
+
+	return main_heap;
+}
+
+/**
+ * Locks heap and frees the blocks other threads handed back to it.
+ */
+void heap_lock(heap_t *heap)
+{
+	pthread_mutex_lock(&heap->lock);
+
+	if (__atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED))
+		remote_free_drain(heap);
+}
+
+void heap_unlock(heap_t *heap)
+{
+	pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * Pushes ptr on the remote free queue of heap. The queue is a lock-free
+ * stack linked through the first word of the payloads, so any number
+ * of threads can push while the owner drains it.
+ */
+void remote_free_push(heap_t *heap, void *ptr)
+{
+	void *old_head = __atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED);
+
+	do {
+		*(void **)ptr = old_head;
+	} while (!__atomic_compare_exchange_n(&heap->remote_frees, &old_head, ptr, 1,
+										  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	STATS_ADD(nremote_free, 1);
+}
+
+/**
+ * Detaches the whole remote free queue of heap and frees its blocks.
+ * The heap lock must be held.
+ */
+void remote_free_drain(heap_t *heap)
+{
+	void *ptr = __atomic_exchange_n(&heap->remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+	while (ptr) {
+		void *next = *(void **)ptr;
+
+		heap_free(heap, ptr);
+		ptr = next;
+	}
+}
+
+/**
+ * fork() handler: takes every allocator lock, so that no other thread
+ * is inside the allocator while the address space is copied. Locks are
+ * taken in a fixed order: the arena list, the caches, the arenas, the
+ * heaps created with os_heap_create(), the page aligned blocks, then
+ * the unmapping and the purging threads.
+ */
+void osmem_prefork(void)
+{
+	pthread_mutex_lock(&arena_lock);
+	tcache_prefork();
+
+	for (unsigned int i = 0; i < arena_nr; i++) {
+		if (i == 0 || arenas[i].base)
+			pthread_mutex_lock(&arenas[i].lock);
+	}
+
+	user_heaps_prefork();
+	page_blocks_prefork();
+	buddy_prefork();
+	page_heap_prefork();
+	unmap_prefork();
+	decay_prefork();
+}
+
+void osmem_postfork_parent(void)
+{
+	decay_postfork_parent();
+	unmap_postfork_parent();
+	page_heap_postfork_parent();
+	buddy_postfork_parent();
+	page_blocks_postfork_parent();
+	user_heaps_postfork_parent();
+
+	for (unsigned int i = arena_nr; i > 0; i--) {
+		if (i == 1 || arenas[i - 1].base)
+			pthread_mutex_unlock(&arenas[i - 1].lock);
+	}
+
+	tcache_postfork_parent();
+	pthread_mutex_unlock(&arena_lock);
+}
+
+/**
+ * fork() handler of the child: only the forking thread exists, so the
+ * locks are reinitialized instead of being released, and the caches of
+ * the other threads are returned to their heaps.
+ */
+void osmem_postfork_child(void)
+{
+	for (unsigned int i = 0; i < arena_nr; i++) {
+		if (i == 0 || arenas[i].base)
+			pthread_mutex_init(&arenas[i].lock, NULL);
+	}
+
+	pthread_mutex_init(&arena_lock, NULL);
+	user_heaps_postfork_child();
+	page_blocks_postfork_child();
+	buddy_postfork_child();
+	page_heap_postfork_child();
+	unmap_postfork_child();
+	decay_postfork_child();
+	tcache_postfork_child();
+}
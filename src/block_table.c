@@ -0,0 +1,287 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * With block_table enabled, the free blocks of a heap are indexed in a
+ * side table mapped apart from the heap: an array of their address,
+ * payload size and purge state, sorted by address. The placement
+ * policies, the merges of a freed block with its free neighbours and
+ * the purges of the decay read these dense entries, a few cache lines
+ * for many blocks, instead of one header per block spread across the
+ * heap. The pages of free blocks are never read or written, so purged
+ * ones stay unfaulted.
+ *
+ * The headers stay in front of the payloads, as the block list and the
+ * lookups of freed pointers still go through them. A free block is not
+ * resized while it is in the table, and its purge state is only kept
+ * in its entry, then written back to the header when it leaves.
+ */
+struct block_entry {
+	block_meta_t *block;
+	size_t size;
+	unsigned int purge;
+};
+
+char *block_entry_end(struct block_entry *entry)
+{
+	return (char *)entry->block + META_BLOCK_SIZE + entry->size;
+}
+
+/**
+ * @return the index of the first entry of heap at or after block.
+ */
+size_t block_table_find(heap_t *heap, block_meta_t *block)
+{
+	size_t low = 0, high = heap->block_table_len;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		if (heap->block_table[mid].block < block)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/**
+ * Moves the entries of heap to a table twice as large, or of a page
+ * for the first one.
+ * @return 1 for success, 0 otherwise.
+ */
+int block_table_grow(heap_t *heap)
+{
+	size_t old_size = heap->block_table_cap * sizeof(struct block_entry);
+	size_t size = old_size ? 2 * old_size : (size_t)getpagesize();
+	struct block_entry *table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+									 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (table == MAP_FAILED)
+		return 0;
+
+	STATS_ADD(nmmap, 1);
+
+	if (heap->block_table) {
+		memcpy(table, heap->block_table, heap->block_table_len * sizeof(*table));
+		DIE(munmap(heap->block_table, old_size) == -1,
+			"Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+	}
+
+	heap->block_table = table;
+	heap->block_table_cap = size / sizeof(struct block_entry);
+	return 1;
+}
+
+void block_table_destroy(heap_t *heap)
+{
+	if (!heap->block_table)
+		return;
+
+	DIE(munmap(heap->block_table, heap->block_table_cap * sizeof(struct block_entry)) == -1,
+		"Critical error: munmap() failed.\n");
+
+	STATS_ADD(nmunmap, 1);
+	heap->block_table = NULL;
+	heap->block_table_len = 0;
+	heap->block_table_cap = 0;
+}
+
+/**
+ * Indexes the free block. If the table can not grow, the block is left
+ * out: it is then only found by the walks of the block list, when the
+ * heap is trimmed or a block grows into it.
+ */
+void block_table_insert(heap_t *heap, block_meta_t *block)
+{
+	if (heap->block_table_len == heap->block_table_cap && !block_table_grow(heap))
+		return;
+
+	size_t pos = block_table_find(heap, block);
+	struct block_entry *entry = &heap->block_table[pos];
+
+	memmove(entry + 1, entry, (heap->block_table_len - pos) * sizeof(*entry));
+	heap->block_table_len++;
+
+	entry->block = block;
+	entry->size = block->size;
+	entry->purge = block->purge;
+}
+
+void block_table_remove_at(heap_t *heap, size_t pos)
+{
+	struct block_entry *entry = &heap->block_table[pos];
+
+	entry->block->purge = entry->purge;
+
+	heap->block_table_len--;
+	memmove(entry, entry + 1, (heap->block_table_len - pos) * sizeof(*entry));
+}
+
+/**
+ * Removes the free block from the index, if it is there.
+ */
+void block_table_remove(heap_t *heap, block_meta_t *block)
+{
+	size_t pos = block_table_find(heap, block);
+
+	if (pos < heap->block_table_len && heap->block_table[pos].block == block)
+		block_table_remove_at(heap, pos);
+}
+
+/**
+ * Merges the freed block with the free blocks right before and after
+ * it, found next to its place in the table, and indexes the result.
+ */
+void block_table_release(heap_t *heap, block_meta_t *block)
+{
+	size_t pos = block_table_find(heap, block);
+
+	if (pos > 0 && block_entry_end(&heap->block_table[pos - 1]) == (char *)block) {
+		block_meta_t *prev = heap->block_table[pos - 1].block;
+
+		block_table_remove_at(heap, --pos);
+		coalesce_blocks(heap, prev, block);
+		block = prev;
+	}
+
+	if (pos < heap->block_table_len &&
+		(char *)heap->block_table[pos].block == (char *)block + META_BLOCK_SIZE + block->size) {
+		block_meta_t *next = heap->block_table[pos].block;
+
+		block_table_remove_at(heap, pos);
+		coalesce_blocks(heap, block, next);
+	}
+
+	block_table_insert(heap, block);
+}
+
+/**
+ * @return the smallest free block of at least size bytes, the lowest
+ * one on ties, or NULL if there is none.
+ */
+block_meta_t *block_table_best_fit(heap_t *heap, size_t size)
+{
+	struct block_entry *best = NULL;
+
+	for (size_t i = 0; i < heap->block_table_len; i++) {
+		struct block_entry *entry = &heap->block_table[i];
+
+		if (entry->size >= size && (!best || entry->size < best->size))
+			best = entry;
+	}
+
+	return best ? best->block : NULL;
+}
+
+/**
+ * @return the free block of at least size bytes at the lowest address,
+ * or NULL if there is none.
+ */
+block_meta_t *block_table_first_fit(heap_t *heap, size_t size)
+{
+	for (size_t i = 0; i < heap->block_table_len; i++) {
+		if (heap->block_table[i].size >= size)
+			return heap->block_table[i].block;
+	}
+
+	return NULL;
+}
+
+/**
+ * @return the first free block of at least size bytes after the block
+ * handed out last, wrapping around the table once, or NULL.
+ */
+block_meta_t *block_table_next_fit(heap_t *heap, size_t size)
+{
+	size_t len = heap->block_table_len;
+	size_t start = 0;
+
+	if (heap->rover) {
+		start = block_table_find(heap, heap->rover);
+		if (start < len && heap->block_table[start].block == heap->rover)
+			start++;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		struct block_entry *entry = &heap->block_table[(start + i) % len];
+
+		if (entry->size >= size) {
+			heap->rover = entry->block;
+			return entry->block;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Good fit over the table, as find_good_block() does over the list.
+ */
+block_meta_t *block_table_good_fit(heap_t *heap, size_t size)
+{
+	struct block_entry *best = NULL;
+	unsigned int candidates = 0;
+
+	for (size_t i = 0; i < heap->block_table_len && candidates < GOOD_FIT_CANDIDATES; i++) {
+		struct block_entry *entry = &heap->block_table[i];
+
+		if (entry->size < size)
+			continue;
+
+		if (entry->size - size <= size / GOOD_FIT_SLACK)
+			return entry->block;
+
+		if (!best || entry->size < best->size)
+			best = entry;
+
+		candidates++;
+	}
+
+	return best ? best->block : NULL;
+}
+
+/**
+ * Adds the pages of the free blocks of heap to the counters of their
+ * purge state.
+ */
+void block_table_count_pages(heap_t *heap, size_t npages[PURGE_STATES])
+{
+	for (size_t i = 0; i < heap->block_table_len; i++) {
+		struct block_entry *entry = &heap->block_table[i];
+
+		npages[entry->purge] += free_block_pages(entry->block, entry->size, NULL);
+	}
+}
+
+/**
+ * Purges at least npages pages of the free blocks of heap in state
+ * from, as heap_purge() does.
+ * @return the number of pages purged.
+ */
+size_t block_table_purge(heap_t *heap, int from, int to, size_t npages)
+{
+	size_t purged = 0;
+
+	for (size_t i = 0; i < heap->block_table_len && purged < npages; i++) {
+		struct block_entry *entry = &heap->block_table[i];
+
+		if ((int)entry->purge != from)
+			continue;
+
+		char *start;
+		size_t block_pages = free_block_pages(entry->block, entry->size, &start);
+		int state = block_pages ? purge_pages(start, block_pages, to) : -1;
+
+		if (state < 0)
+			continue;
+
+		entry->purge = state;
+		purged += block_pages;
+	}
+
+	return purged;
+}
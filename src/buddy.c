@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * With buddy enabled, the requests of at least BUDDY_MIN_SIZE bytes that
+ * would be split out of the heap are served from a zone of
+ * BUDDY_ZONE_SIZE bytes instead, reserved on first use. The zone is
+ * handed out in blocks of a power of two bytes, aligned to their size, so
+ * the buddy of a block is found by flipping one bit of its offset. A
+ * block is split in halves until it fits a request and merged with its
+ * buddy as long as the buddy is free, both in at most BUDDY_ORDERS steps.
+ *
+ * Blocks have no header. The order of the allocated blocks is kept in a
+ * byte per BUDDY_MIN_SIZE bytes of the zone, a bitmap tells which
+ * blocks of each order are free and another one where allocated blocks
+ * start, so interior pointers and double frees are ignored.
+ *
+ * Free blocks of order BUDDY_PURGE_LOG2 or more are purged with
+ * MADV_DONTNEED as soon as they form, before their list node is written,
+ * so a zone that emptied again uses a page per free block. Smaller free
+ * blocks are kept dirty, to be reused without page faults.
+ */
+#define BUDDY_ORDERS		(BUDDY_ZONE_LOG2 - BUDDY_MIN_LOG2 + 1)
+#define BUDDY_MAP_BITS		(2UL << (BUDDY_ZONE_LOG2 - BUDDY_MIN_LOG2))
+#define BUDDY_MAP_WORDS		(BUDDY_MAP_BITS / (8 * sizeof(unsigned long)))
+#define BUDDY_UNITS		(1UL << (BUDDY_ZONE_LOG2 - BUDDY_MIN_LOG2))
+
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+struct buddy_node {
+	struct buddy_node *next;
+	struct buddy_node *prev;
+};
+
+struct buddy_zone {
+	char *base;
+	struct buddy_node *free[BUDDY_ORDERS];
+	unsigned long free_map[BUDDY_MAP_WORDS];
+	unsigned long alloc_map[BUDDY_UNITS / (8 * sizeof(unsigned long))];
+	unsigned char order[BUDDY_UNITS];
+};
+
+struct buddy_zone buddy;
+pthread_mutex_t buddy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @return the bit of the block at offset in the free bitmap of its
+ * order. Orders are laid out one after the other, the biggest first.
+ */
+size_t buddy_bit(size_t offset, unsigned int order)
+{
+	return (1UL << (BUDDY_ZONE_LOG2 - order)) + (offset >> order);
+}
+
+int buddy_is_free(size_t offset, unsigned int order)
+{
+	size_t bit = buddy_bit(offset, order);
+
+	return (buddy.free_map[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
+void buddy_insert(size_t offset, unsigned int order)
+{
+	struct buddy_node *node = (struct buddy_node *)(buddy.base + offset);
+	struct buddy_node **head = &buddy.free[order - BUDDY_MIN_LOG2];
+	size_t bit = buddy_bit(offset, order);
+
+	node->next = *head;
+	node->prev = NULL;
+	if (*head)
+		(*head)->prev = node;
+	*head = node;
+
+	buddy.free_map[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+}
+
+void buddy_remove(size_t offset, unsigned int order)
+{
+	struct buddy_node *node = (struct buddy_node *)(buddy.base + offset);
+	size_t bit = buddy_bit(offset, order);
+
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		buddy.free[order - BUDDY_MIN_LOG2] = node->next;
+
+	if (node->next)
+		node->next->prev = node->prev;
+
+	buddy.free_map[bit / BITS_PER_LONG] &= ~(1UL << (bit % BITS_PER_LONG));
+}
+
+/**
+ * Reserves the zone, as a single free block, on first use.
+ * @return 1 for success, 0 otherwise.
+ */
+int buddy_zone_init(void)
+{
+	if (buddy.base)
+		return 1;
+
+	char *base = mmap(NULL, BUDDY_ZONE_SIZE, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (base == MAP_FAILED)
+		return 0;
+
+	STATS_ADD(nmmap, 1);
+
+	__atomic_store_n(&buddy.base, base, __ATOMIC_RELEASE);
+	buddy_insert(0, BUDDY_ZONE_LOG2);
+
+	return 1;
+}
+
+/**
+ * @return the order of the smallest block holding size bytes.
+ */
+unsigned int buddy_order(size_t size)
+{
+	if (size <= BUDDY_MIN_SIZE)
+		return BUDDY_MIN_LOG2;
+
+	return 64 - __builtin_clzl(size - 1);
+}
+
+/**
+ * Gives the upper halves of the block at offset back to the zone until
+ * the block is of order to, and records it as allocated. The lock must
+ * be held.
+ */
+void buddy_split(size_t offset, unsigned int order, unsigned int to)
+{
+	size_t unit = offset >> BUDDY_MIN_LOG2;
+
+	while (order > to) {
+		order--;
+		buddy_insert(offset + (1UL << order), order);
+	}
+
+	buddy.order[unit] = to;
+	buddy.alloc_map[unit / BITS_PER_LONG] |= 1UL << (unit % BITS_PER_LONG);
+}
+
+/**
+ * @return the order of the allocated block at offset, or 0 if no
+ * allocated block starts there, as for an interior pointer or a block
+ * already freed. The lock must be held.
+ */
+unsigned int buddy_alloc_order(size_t offset)
+{
+	size_t unit = offset >> BUDDY_MIN_LOG2;
+
+	if ((offset & (BUDDY_MIN_SIZE - 1)) ||
+		!((buddy.alloc_map[unit / BITS_PER_LONG] >> (unit % BITS_PER_LONG)) & 1))
+		return 0;
+
+	unsigned int order = buddy.order[unit];
+
+	if (offset & ((1UL << order) - 1))
+		return 0;
+
+	return order;
+}
+
+/**
+ * Returns the pages of size bytes at offset to the OS. The lock must be
+ * held.
+ */
+void buddy_purge(size_t offset, size_t size)
+{
+	DIE(madvise(buddy.base + offset, size, MADV_DONTNEED) == -1,
+		"Critical error: madvise() failed.\n");
+
+	STATS_ADD(npurged, size / getpagesize());
+}
+
+/**
+ * @return the offset of ptr in the zone, or -1 if it is not a buddy
+ * block.
+ */
+long buddy_offset(void *ptr)
+{
+	char *base = __atomic_load_n(&buddy.base, __ATOMIC_ACQUIRE);
+
+	if (!base || (char *)ptr < base || (char *)ptr >= base + BUDDY_ZONE_SIZE)
+		return -1;
+
+	return (char *)ptr - base;
+}
+
+/**
+ * Allocates a buddy block of at least size bytes, if size is in the
+ * range served by the zone.
+ * @return the block, or NULL if size is out of range or the zone is full.
+ */
+void *buddy_alloc(size_t size)
+{
+	if (size < BUDDY_MIN_SIZE || size + META_BLOCK_SIZE >= conf.mmap_threshold ||
+		size > BUDDY_ZONE_SIZE || conf.alignment > BUDDY_MIN_SIZE)
+		return NULL;
+
+	unsigned int order = buddy_order(size);
+	void *result = NULL;
+
+	pthread_mutex_lock(&buddy_lock);
+
+	if (!buddy_zone_init())
+		goto out;
+
+	for (unsigned int from = order; from <= BUDDY_ZONE_LOG2; from++) {
+		struct buddy_node *node = buddy.free[from - BUDDY_MIN_LOG2];
+
+		if (!node)
+			continue;
+
+		size_t offset = (char *)node - buddy.base;
+
+		buddy_remove(offset, from);
+		buddy_split(offset, from, order);
+		result = node;
+		break;
+	}
+
+out:
+	pthread_mutex_unlock(&buddy_lock);
+
+	return result;
+}
+
+/**
+ * Merges the block at offset with its buddy for as long as the buddy is
+ * free, then makes it free. If the result is big enough to be purged,
+ * so is the part of it that was in use or in smaller free blocks, the
+ * bigger buddies being purged already. The lock must be held.
+ */
+void buddy_release(size_t offset, unsigned int order)
+{
+	size_t dirty = offset;
+	unsigned int dirty_order = order;
+
+	while (order < BUDDY_ZONE_LOG2) {
+		size_t mate = offset ^ (1UL << order);
+
+		if (!buddy_is_free(mate, order))
+			break;
+
+		buddy_remove(mate, order);
+		offset &= ~(1UL << order);
+		order++;
+
+		if (order <= BUDDY_PURGE_LOG2) {
+			dirty = offset;
+			dirty_order = order;
+		}
+	}
+
+	if (order >= BUDDY_PURGE_LOG2)
+		buddy_purge(dirty, 1UL << dirty_order);
+
+	buddy_insert(offset, order);
+}
+
+/**
+ * Frees ptr if it is in the zone. Pointers that do not start an
+ * allocated block are ignored.
+ * @return 1 if ptr is in the zone, 0 otherwise.
+ */
+int buddy_free(void *ptr)
+{
+	long offset = buddy_offset(ptr);
+
+	if (offset < 0)
+		return 0;
+
+	pthread_mutex_lock(&buddy_lock);
+
+	unsigned int order = buddy_alloc_order(offset);
+
+	if (order) {
+		size_t unit = offset >> BUDDY_MIN_LOG2;
+
+		buddy.alloc_map[unit / BITS_PER_LONG] &= ~(1UL << (unit % BITS_PER_LONG));
+		buddy_release(offset, order);
+	}
+
+	pthread_mutex_unlock(&buddy_lock);
+
+	return 1;
+}
+
+/**
+ * Grows the block at offset in place, taking in its free buddies while
+ * it is their lower half, until it holds size bytes. The lock must be
+ * held.
+ * @return the new order of the block.
+ */
+unsigned int buddy_grow(size_t offset, size_t size)
+{
+	unsigned int order = buddy.order[offset >> BUDDY_MIN_LOG2];
+	unsigned int target = buddy_order(size);
+
+	while (order < target && order < BUDDY_ZONE_LOG2 &&
+		   !(offset & (1UL << order)) && buddy_is_free(offset | (1UL << order), order)) {
+		buddy_remove(offset | (1UL << order), order);
+		order++;
+	}
+
+	buddy.order[offset >> BUDDY_MIN_LOG2] = order;
+
+	return order;
+}
+
+/**
+ * Resizes ptr if it is a buddy block. The block is split or grown in
+ * place when it can be, otherwise it is moved to a new block.
+ * @return 1 if ptr was a buddy block, with the new payload or NULL
+ * stored in *result, 0 otherwise.
+ */
+int buddy_realloc(void *ptr, size_t size, void **result)
+{
+	long offset = buddy_offset(ptr);
+
+	if (offset < 0)
+		return 0;
+
+	pthread_mutex_lock(&buddy_lock);
+
+	unsigned int order = buddy_alloc_order(offset);
+
+	if (!order) {
+		pthread_mutex_unlock(&buddy_lock);
+		*result = NULL;
+		return 1;
+	}
+
+	if (size <= (1UL << order)) {
+		unsigned int to = buddy_order(size);
+		size_t keep = 1UL << (to > BUDDY_PURGE_LOG2 ? to : BUDDY_PURGE_LOG2);
+
+		// The halves given back were in use, so those big enough are
+		// purged before their list nodes are written.
+		if (keep < (1UL << order))
+			buddy_purge(offset + keep, (1UL << order) - keep);
+
+		buddy_split(offset, order, to);
+		pthread_mutex_unlock(&buddy_lock);
+		*result = ptr;
+		return 1;
+	}
+
+	if (size <= BUDDY_ZONE_SIZE && buddy_grow(offset, size) == buddy_order(size)) {
+		pthread_mutex_unlock(&buddy_lock);
+		*result = ptr;
+		return 1;
+	}
+
+	// Gives back what was taken in by buddy_grow().
+	buddy_split(offset, buddy.order[offset >> BUDDY_MIN_LOG2], order);
+
+	pthread_mutex_unlock(&buddy_lock);
+
+	*result = os_malloc(size);
+	if (*result) {
+		bulk_copy(*result, ptr, 1UL << order);
+		buddy_free(ptr);
+	}
+
+	return 1;
+}
+
+/**
+ * Grows ptr in place if it is a buddy block, to preferred_size or else
+ * min_size bytes, rounded up to the size of the block.
+ * @return 1 if ptr was a buddy block, with the new size or 0 on failure
+ * stored in *result, 0 otherwise.
+ */
+int buddy_expand(void *ptr, size_t min_size, size_t preferred_size, size_t *result)
+{
+	long offset = buddy_offset(ptr);
+
+	if (offset < 0)
+		return 0;
+
+	if (preferred_size > BUDDY_ZONE_SIZE)
+		preferred_size = BUDDY_ZONE_SIZE;
+
+	pthread_mutex_lock(&buddy_lock);
+
+	unsigned int order = buddy_alloc_order(offset);
+
+	if (!order) {
+		pthread_mutex_unlock(&buddy_lock);
+		*result = 0;
+		return 1;
+	}
+
+	unsigned int grown = buddy_grow(offset, preferred_size);
+
+	if ((1UL << grown) >= min_size) {
+		*result = 1UL << grown;
+	} else {
+		buddy_split(offset, grown, order);
+		*result = 0;
+	}
+
+	pthread_mutex_unlock(&buddy_lock);
+
+	return 1;
+}
+
+void buddy_prefork(void)
+{
+	pthread_mutex_lock(&buddy_lock);
+}
+
+void buddy_postfork_parent(void)
+{
+	pthread_mutex_unlock(&buddy_lock);
+}
+
+void buddy_postfork_child(void)
+{
+	pthread_mutex_init(&buddy_lock, NULL);
+}
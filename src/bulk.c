@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BULK_X86 1
+#endif
+
+/**
+ * Zeroing and copying of payloads of at least nt_threshold bytes, as
+ * done by os_calloc() and os_realloc() on big blocks. Such payloads do
+ * not fit in the cache, so they are written with non-temporal stores,
+ * which go to memory without evicting the working set of the program.
+ * The widest kernel the CPU supports is chosen on first use.
+ */
+struct bulk_kernels {
+	void (*zero)(void *dest, size_t size);
+	void (*copy)(void *dest, const void *src, size_t size);
+};
+
+void bulk_zero_plain(void *dest, size_t size)
+{
+	memset(dest, 0, size);
+}
+
+void bulk_copy_plain(void *dest, const void *src, size_t size)
+{
+	memcpy(dest, src, size);
+}
+
+#ifdef BULK_X86
+
+/**
+ * Every kernel writes the bytes up to the first vector boundary of dest
+ * with plain stores, streams whole vectors, then writes the tail.
+ * @return the bytes before the boundary, at most size.
+ */
+size_t bulk_head(const void *dest, size_t width, size_t size)
+{
+	size_t head = (-(uintptr_t)dest) & (width - 1);
+
+	return head < size ? head : size;
+}
+
+__attribute__((target("sse2")))
+void bulk_zero_sse2(void *dest, size_t size)
+{
+	size_t head = bulk_head(dest, 16, size);
+	char *d = (char *)dest + head;
+	__m128i zero = _mm_setzero_si128();
+
+	memset(dest, 0, head);
+	size -= head;
+
+	for (; size >= 64; size -= 64, d += 64) {
+		_mm_stream_si128((__m128i *)d, zero);
+		_mm_stream_si128((__m128i *)(d + 16), zero);
+		_mm_stream_si128((__m128i *)(d + 32), zero);
+		_mm_stream_si128((__m128i *)(d + 48), zero);
+	}
+
+	_mm_sfence();
+	memset(d, 0, size);
+}
+
+__attribute__((target("sse2")))
+void bulk_copy_sse2(void *dest, const void *src, size_t size)
+{
+	size_t head = bulk_head(dest, 16, size);
+	char *d = (char *)dest + head;
+	const char *s = (const char *)src + head;
+
+	memcpy(dest, src, head);
+	size -= head;
+
+	for (; size >= 64; size -= 64, d += 64, s += 64) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)s);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i v3 = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)d, v0);
+		_mm_stream_si128((__m128i *)(d + 16), v1);
+		_mm_stream_si128((__m128i *)(d + 32), v2);
+		_mm_stream_si128((__m128i *)(d + 48), v3);
+	}
+
+	_mm_sfence();
+	memcpy(d, s, size);
+}
+
+__attribute__((target("avx2")))
+void bulk_zero_avx2(void *dest, size_t size)
+{
+	size_t head = bulk_head(dest, 32, size);
+	char *d = (char *)dest + head;
+	__m256i zero = _mm256_setzero_si256();
+
+	memset(dest, 0, head);
+	size -= head;
+
+	for (; size >= 128; size -= 128, d += 128) {
+		_mm256_stream_si256((__m256i *)d, zero);
+		_mm256_stream_si256((__m256i *)(d + 32), zero);
+		_mm256_stream_si256((__m256i *)(d + 64), zero);
+		_mm256_stream_si256((__m256i *)(d + 96), zero);
+	}
+
+	_mm_sfence();
+	memset(d, 0, size);
+}
+
+__attribute__((target("avx2")))
+void bulk_copy_avx2(void *dest, const void *src, size_t size)
+{
+	size_t head = bulk_head(dest, 32, size);
+	char *d = (char *)dest + head;
+	const char *s = (const char *)src + head;
+
+	memcpy(dest, src, head);
+	size -= head;
+
+	for (; size >= 128; size -= 128, d += 128, s += 128) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)s);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+		__m256i v2 = _mm256_loadu_si256((const __m256i *)(s + 64));
+		__m256i v3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+
+		_mm256_stream_si256((__m256i *)d, v0);
+		_mm256_stream_si256((__m256i *)(d + 32), v1);
+		_mm256_stream_si256((__m256i *)(d + 64), v2);
+		_mm256_stream_si256((__m256i *)(d + 96), v3);
+	}
+
+	_mm_sfence();
+	memcpy(d, s, size);
+}
+
+__attribute__((target("avx512f")))
+void bulk_zero_avx512(void *dest, size_t size)
+{
+	size_t head = bulk_head(dest, 64, size);
+	char *d = (char *)dest + head;
+	__m512i zero = _mm512_setzero_si512();
+
+	memset(dest, 0, head);
+	size -= head;
+
+	for (; size >= 256; size -= 256, d += 256) {
+		_mm512_stream_si512((__m512i *)d, zero);
+		_mm512_stream_si512((__m512i *)(d + 64), zero);
+		_mm512_stream_si512((__m512i *)(d + 128), zero);
+		_mm512_stream_si512((__m512i *)(d + 192), zero);
+	}
+
+	_mm_sfence();
+	memset(d, 0, size);
+}
+
+__attribute__((target("avx512f")))
+void bulk_copy_avx512(void *dest, const void *src, size_t size)
+{
+	size_t head = bulk_head(dest, 64, size);
+	char *d = (char *)dest + head;
+	const char *s = (const char *)src + head;
+
+	memcpy(dest, src, head);
+	size -= head;
+
+	for (; size >= 256; size -= 256, d += 256, s += 256) {
+		__m512i v0 = _mm512_loadu_si512((const void *)s);
+		__m512i v1 = _mm512_loadu_si512((const void *)(s + 64));
+		__m512i v2 = _mm512_loadu_si512((const void *)(s + 128));
+		__m512i v3 = _mm512_loadu_si512((const void *)(s + 192));
+
+		_mm512_stream_si512((__m512i *)d, v0);
+		_mm512_stream_si512((__m512i *)(d + 64), v1);
+		_mm512_stream_si512((__m512i *)(d + 128), v2);
+		_mm512_stream_si512((__m512i *)(d + 192), v3);
+	}
+
+	_mm_sfence();
+	memcpy(d, s, size);
+}
+
+#endif
+
+struct bulk_kernels bulk;
+
+/**
+ * Picks the widest kernels supported by the CPU, as reported by CPUID.
+ * Racing callers pick the same ones, so no lock is needed.
+ */
+void bulk_init(void)
+{
+	struct bulk_kernels kernels = { bulk_zero_plain, bulk_copy_plain };
+
+#ifdef BULK_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		kernels.zero = bulk_zero_avx512;
+		kernels.copy = bulk_copy_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		kernels.zero = bulk_zero_avx2;
+		kernels.copy = bulk_copy_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernels.zero = bulk_zero_sse2;
+		kernels.copy = bulk_copy_sse2;
+	}
+#endif
+
+	__atomic_store_n(&bulk.copy, kernels.copy, __ATOMIC_RELAXED);
+	__atomic_store_n(&bulk.zero, kernels.zero, __ATOMIC_RELEASE);
+}
+
+/**
+ * Zeroes size bytes at dest, bypassing the cache from nt_threshold bytes.
+ */
+void bulk_zero(void *dest, size_t size)
+{
+	if (!conf.nt_threshold || size < conf.nt_threshold) {
+		memset(dest, 0, size);
+		return;
+	}
+
+	if (!__atomic_load_n(&bulk.zero, __ATOMIC_ACQUIRE))
+		bulk_init();
+
+	bulk.zero(dest, size);
+}
+
+/**
+ * Copies size bytes from src to dest, bypassing the cache from
+ * nt_threshold bytes. The areas may overlap, as for memmove().
+ */
+void bulk_copy(void *dest, const void *src, size_t size)
+{
+	int overlap = (char *)dest < (char *)src + size && (char *)src < (char *)dest + size;
+
+	if (!conf.nt_threshold || size < conf.nt_threshold || overlap) {
+		memmove(dest, src, size);
+		return;
+	}
+
+	if (!__atomic_load_n(&bulk.zero, __ATOMIC_ACQUIRE))
+		bulk_init();
+
+	bulk.copy(dest, src, size);
+}
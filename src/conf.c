@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "utils_src.h"
+
+struct osmem_conf conf = {
+	.prealloc_size = HEAP_PREALLOC_SIZE,
+	.mmap_threshold = MMAP_THRESHOLD,
+	.trim_threshold = 0,
+	.alignment = ALIGNMENT,
+	.arena_count = 1,
+	.tcache_size = 0,
+	.dirty_decay_ms = 10000,
+	.muzzy_decay_ms = 0,
+	.stats_enabled = 0,
+	.thp = 0,
+	.remote_free = 1,
+	.percpu = 0,
+	.vm_heap = 0,
+	.free_tree = 0,
+	.block_table = 0,
+	.fit_policy = OS_FIT_BEST,
+	.start_map = 0,
+	.page_align = 0,
+	.async_munmap = 0,
+	.background_thread = 0,
+	.nt_threshold = NT_THRESHOLD,
+	.mmap_hysteresis = 0,
+	.grow_streak = 0,
+	.map_headroom = 0,
+	.fastbins = 0,
+	.buddy = 0,
+	.page_heap = 0,
+	.hugepage_filler = 0,
+};
+
+pthread_once_t conf_init_once = PTHREAD_ONCE_INIT;
+
+struct conf_key {
+	const char *name;
+	int param;
+};
+
+/**
+ * Keys accepted in the OSMEM_CONF environment variable. The string is
+ * a comma separated list of key:value pairs, e.g.
+ * OSMEM_CONF="prealloc:256k,mmap_threshold:1m,stats:1".
+ */
+const struct conf_key conf_keys[] = {
+	{ "prealloc", OS_M_PREALLOC_SIZE },
+	{ "mmap_threshold", OS_M_MMAP_THRESHOLD },
+	{ "trim_threshold", OS_M_TRIM_THRESHOLD },
+	{ "alignment", OS_M_ALIGNMENT },
+	{ "arenas", OS_M_ARENA_COUNT },
+	{ "tcache", OS_M_TCACHE_SIZE },
+	{ "dirty_decay_ms", OS_M_DIRTY_DECAY_MS },
+	{ "muzzy_decay_ms", OS_M_MUZZY_DECAY_MS },
+	{ "stats", OS_M_STATS },
+	{ "thp", OS_M_THP },
+	{ "remote_free", OS_M_REMOTE_FREE },
+	{ "percpu", OS_M_PERCPU },
+	{ "vm_heap", OS_M_VM_HEAP },
+	{ "free_tree", OS_M_FREE_TREE },
+	{ "block_table", OS_M_BLOCK_TABLE },
+	{ "fit", OS_M_FIT_POLICY },
+	{ "start_map", OS_M_START_MAP },
+	{ "page_align", OS_M_PAGE_ALIGN },
+	{ "async_munmap", OS_M_ASYNC_MUNMAP },
+	{ "background_thread", OS_M_BACKGROUND_THREAD },
+	{ "nt_threshold", OS_M_NT_THRESHOLD },
+	{ "mmap_hysteresis", OS_M_MMAP_HYSTERESIS },
+	{ "grow_streak", OS_M_GROW_STREAK },
+	{ "map_headroom", OS_M_MAP_HEADROOM },
+	{ "fastbins", OS_M_FASTBINS },
+	{ "buddy", OS_M_BUDDY },
+	{ "page_heap", OS_M_PAGE_HEAP },
+	{ "hugepage_filler", OS_M_HUGEPAGE_FILLER },
+};
+
+/**
+ * Parses a decimal value, optionally followed by a k, m or g suffix,
+ * which must span exactly len characters of str.
+ * @return 1 for success, 0 if the value is malformed or out of the
+ * range of a long.
+ */
+int conf_parse_value(const char *str, size_t len, long *value)
+{
+	char *end;
+	int shift = 0;
+
+	errno = 0;
+	long result = strtol(str, &end, 10);
+
+	if (end == str || errno == ERANGE)
+		return 0;
+
+	if ((size_t)(end - str) + 1 == len) {
+		switch (*end) {
+		case 'k':
+		case 'K':
+			shift = 10;
+			break;
+		case 'm':
+		case 'M':
+			shift = 20;
+			break;
+		case 'g':
+		case 'G':
+			shift = 30;
+			break;
+		default:
+			return 0;
+		}
+	} else if ((size_t)(end - str) != len) {
+		return 0;
+	}
+
+	if (result > (LONG_MAX >> shift) || result < (LONG_MIN >> shift))
+		return 0;
+
+	*value = result * (1L << shift);
+	return 1;
+}
+
+/**
+ * Applies a single key:value pair of the OSMEM_CONF string.
+ * Malformed pairs are reported and ignored.
+ */
+void conf_parse_pair(const char *pair, size_t len)
+{
+	const char *sep = memchr(pair, ':', len);
+
+	if (sep) {
+		size_t key_len = sep - pair;
+
+		for (size_t i = 0; i < sizeof(conf_keys) / sizeof(conf_keys[0]); i++) {
+			long value;
+
+			if (strlen(conf_keys[i].name) != key_len ||
+				strncmp(conf_keys[i].name, pair, key_len) != 0)
+				continue;
+
+			if (conf_parse_value(sep + 1, len - key_len - 1, &value) &&
+				conf_set(conf_keys[i].param, value))
+				return;
+
+			break;
+		}
+	}
+
+	fprintf(stderr, "osmem: ignoring invalid OSMEM_CONF entry \"%.*s\"\n",
+			(int)len, pair);
+}
+
+void conf_init_routine(void)
+{
+	const char *env = getenv("OSMEM_CONF");
+
+	if (!env)
+		return;
+
+	while (*env) {
+		const char *end = strchr(env, ',');
+		size_t len = end ? (size_t)(end - env) : strlen(env);
+
+		if (len > 0)
+			conf_parse_pair(env, len);
+
+		env += len;
+		if (*env == ',')
+			env++;
+	}
+}
+
+/**
+ * Reads the OSMEM_CONF environment variable. Only the first call
+ * has any effect, so it is safe to call it on every entry point.
+ */
+void conf_init(void)
+{
+	pthread_once(&conf_init_once, conf_init_routine);
+}
+
+/**
+ * Validates and stores a configuration value.
+ * @return 1 for success, 0 if the value is not valid for param.
+ */
+int conf_set(int param, long value)
+{
+	switch (param) {
+	case OS_M_PREALLOC_SIZE:
+		// Takes effect only if the heap has not been preallocated yet.
+		// The arenas preallocate from ranges of ARENA_RESERVE_SIZE.
+		if (value <= (long)META_BLOCK_SIZE || value > ARENA_RESERVE_SIZE)
+			return 0;
+		conf.prealloc_size = ALIGN((size_t)value);
+		return 1;
+	case OS_M_MMAP_THRESHOLD:
+		if (value <= 0 || value > CONF_SIZE_MAX)
+			return 0;
+		conf.mmap_threshold = value;
+		return 1;
+	case OS_M_TRIM_THRESHOLD:
+		// A threshold of 0 disables trimming.
+		if (value < 0 || value > CONF_SIZE_MAX)
+			return 0;
+		conf.trim_threshold = value;
+		return 1;
+	case OS_M_ALIGNMENT:
+		// The block layout depends on the alignment, so it is fixed
+		// once the first block has been created.
+		if (head_init_done || value < ALIGNMENT || value > getpagesize() ||
+			(value & (value - 1)))
+			return 0;
+		conf.alignment = value;
+		return 1;
+	case OS_M_ARENA_COUNT:
+		if (value < 1 || value > ARENA_COUNT_MAX)
+			return 0;
+		conf.arena_count = value;
+		return 1;
+	case OS_M_TCACHE_SIZE:
+		if (value < 0 || value > TCACHE_SIZE_MAX)
+			return 0;
+		conf.tcache_size = value;
+		return 1;
+	case OS_M_DIRTY_DECAY_MS:
+		// -1 disables purging, 0 purges immediately.
+		if (value < -1)
+			return 0;
+		conf.dirty_decay_ms = value;
+		return 1;
+	case OS_M_MUZZY_DECAY_MS:
+		if (value < -1)
+			return 0;
+		conf.muzzy_decay_ms = value;
+		return 1;
+	case OS_M_STATS:
+		// Counters not kept for the existing blocks would wrap when
+		// these are freed.
+		if (head_init_done)
+			return 0;
+		conf.stats_enabled = (value != 0);
+		return 1;
+	case OS_M_THP:
+		conf.thp = (value != 0);
+		return 1;
+	case OS_M_REMOTE_FREE:
+		conf.remote_free = (value != 0);
+		return 1;
+	case OS_M_PERCPU:
+		// Read once, when the caches are first used.
+		conf.percpu = (value != 0);
+		return 1;
+	case OS_M_VM_HEAP:
+		// Size of the range reserved for the main heap, 0 keeps sbrk().
+		// The main heap is set up on the first allocation.
+		if (head_init_done || value < 0 || value > CONF_SIZE_MAX)
+			return 0;
+		conf.vm_heap = (value + getpagesize() - 1) & ~((long)getpagesize() - 1);
+		return 1;
+	case OS_M_FREE_TREE:
+		// The free blocks of existing heaps would not be indexed.
+		if (head_init_done)
+			return 0;
+		conf.free_tree = (value != 0);
+		return 1;
+	case OS_M_BLOCK_TABLE:
+		// The free blocks of existing heaps would not be indexed.
+		if (head_init_done)
+			return 0;
+		conf.block_table = (value != 0);
+		return 1;
+	case OS_M_FIT_POLICY:
+		if (value < OS_FIT_BEST || value > OS_FIT_GOOD)
+			return 0;
+		conf.fit_policy = value;
+		return 1;
+	case OS_M_START_MAP:
+		// Bitmaps are created along with the reserved ranges.
+		if (head_init_done)
+			return 0;
+		conf.start_map = (value != 0);
+		return 1;
+	case OS_M_PAGE_ALIGN:
+		conf.page_align = (value != 0);
+		return 1;
+	case OS_M_ASYNC_MUNMAP:
+		conf.async_munmap = (value != 0);
+		return 1;
+	case OS_M_BACKGROUND_THREAD:
+		// The thread is started on the next free.
+		conf.background_thread = (value != 0);
+		return 1;
+	case OS_M_NT_THRESHOLD:
+		// 0 always zeroes and copies through the cache.
+		if (value < 0 || (value > 0 && value < NT_THRESHOLD_MIN) ||
+			value > CONF_SIZE_MAX)
+			return 0;
+		conf.nt_threshold = value;
+		return 1;
+	case OS_M_MMAP_HYSTERESIS:
+		// 0 moves blocks as soon as they cross the mmap threshold.
+		if (value < 0 || value > CONF_SIZE_MAX)
+			return 0;
+		conf.mmap_hysteresis = value;
+		return 1;
+	case OS_M_GROW_STREAK:
+		// 0 never reserves headroom.
+		if (value < 0 || value > 64)
+			return 0;
+		conf.grow_streak = value;
+		return 1;
+	case OS_M_MAP_HEADROOM:
+		// Only applies to blocks mapped from now on.
+		if (value < 0 || value > CONF_SIZE_MAX)
+			return 0;
+		conf.map_headroom = value;
+		return 1;
+	case OS_M_FASTBINS:
+		conf.fastbins = (value != 0);
+		return 1;
+	case OS_M_BUDDY:
+		// Blocks already in the zone are still freed there when disabled.
+		conf.buddy = (value != 0);
+		return 1;
+	case OS_M_PAGE_HEAP:
+		conf.page_heap = (value != 0);
+		return 1;
+	case OS_M_HUGEPAGE_FILLER:
+		conf.hugepage_filler = (value != 0);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+int os_mallopt(int param, long value)
+{
+	conf_init();
+
+	return conf_set(param, value);
+}
@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <time.h>
+
+#include "utils_src.h"
+
+#ifndef MADV_FREE
+#define MADV_FREE 8
+#endif
+
+/**
+ * With background_thread enabled, the pages of free heap blocks are
+ * returned to the OS by a background thread, never on the allocation
+ * path. Freed pages are dirty. After dirty_decay_ms they are purged
+ * with MADV_FREE and become muzzy: the kernel may reclaim them, but
+ * reusing them costs nothing while it does not. After muzzy_decay_ms
+ * muzzy pages are dropped with MADV_DONTNEED and become clean.
+ *
+ * The time is split in DECAY_STEPS epochs per decay time. The pages
+ * dirtied during each epoch are remembered and the number of pages
+ * allowed to stay unpurged follows a smoothstep curve of their age,
+ * so a burst of frees is purged gradually rather than all at once.
+ */
+
+int decay_thread_state;
+pthread_mutex_t decay_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @return the monotonic time in milliseconds.
+ */
+uint64_t decay_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Finds the whole pages of the payload of size bytes of a free block,
+ * past the bytes a free tree node may use.
+ * @return the number of pages, 0 if there is none.
+ */
+size_t free_block_pages(block_meta_t *block, size_t size, char **start)
+{
+	uintptr_t page_size = getpagesize();
+	uintptr_t payload = (uintptr_t)block + META_BLOCK_SIZE;
+	uintptr_t first = (payload + FREE_NODE_SIZE + page_size - 1) & ~(page_size - 1);
+	uintptr_t last = (payload + size) & ~(page_size - 1);
+
+	if (last <= first)
+		return 0;
+
+	if (start)
+		*start = (char *)first;
+
+	return (last - first) / page_size;
+}
+
+/**
+ * Adds the pages of the free blocks of heap to the counters of their
+ * purge state, an array of PURGE_STATES sizes. The heap lock must be
+ * held.
+ */
+void heap_count_pages(heap_t *heap, void *arg)
+{
+	size_t *npages = arg;
+
+	if (conf.block_table) {
+		block_table_count_pages(heap, npages);
+		return;
+	}
+
+	for (block_meta_t *iterator = heap->head.next; iterator != &heap->head;
+		 iterator = iterator->next) {
+		if (iterator->status == STATUS_FREE)
+			npages[iterator->purge] += free_block_pages(iterator, iterator->size, NULL);
+	}
+}
+
+/**
+ * Calls fn on every arena and every heap created with os_heap_create(),
+ * with the lock of the heap held.
+ */
+void heaps_walk(void (*fn)(heap_t *heap, void *arg), void *arg)
+{
+	unsigned int nr = __atomic_load_n(&arena_nr, __ATOMIC_ACQUIRE);
+
+	if (nr == 0)
+		nr = 1;
+
+	for (unsigned int i = 0; i < nr; i++) {
+		if (i == 0 ? !head_init_done : !arenas[i].base)
+			continue;
+
+		heap_lock(&arenas[i]);
+		fn(&arenas[i], arg);
+		heap_unlock(&arenas[i]);
+	}
+
+	pthread_mutex_lock(&user_heaps_lock);
+
+	for (heap_t *heap = user_heaps; heap; heap = heap->next) {
+		heap_lock(heap);
+		fn(heap, arg);
+		heap_unlock(heap);
+	}
+
+	pthread_mutex_unlock(&user_heaps_lock);
+}
+
+/**
+ * Moves the epochs of decay forward to now and records the pages
+ * that became unpurged meanwhile as the newest ones.
+ * @return the number of pages allowed to stay unpurged, or -1 if the
+ * current epoch is not over yet.
+ */
+long decay_limit(struct decay *decay, size_t npages, long decay_ms, uint64_t now)
+{
+	if (decay_ms == 0) {
+		memset(decay->backlog, 0, sizeof(decay->backlog));
+		return 0;
+	}
+
+	uint64_t epoch_ms = decay_ms / DECAY_STEPS ? decay_ms / DECAY_STEPS : 1;
+
+	if (!decay->epoch_start)
+		decay->epoch_start = now;
+
+	uint64_t elapsed = (now - decay->epoch_start) / epoch_ms;
+
+	if (elapsed == 0)
+		return -1;
+
+	for (int k = DECAY_STEPS - 1; k >= 0; k--)
+		decay->backlog[k] = (uint64_t)k >= elapsed ? decay->backlog[k - elapsed] : 0;
+
+	decay->backlog[0] = npages > decay->nunpurged ? npages - decay->nunpurged : 0;
+	decay->epoch_start += elapsed * epoch_ms;
+
+	// Pages k epochs old are kept with a weight of 1 - smoothstep(k / S),
+	// computed in units of 1 / S^3.
+	const uint64_t steps = DECAY_STEPS;
+	uint64_t limit = 0;
+
+	for (uint64_t k = 0; k < steps; k++) {
+		uint64_t weight = steps * steps * steps - (3 * k * k * steps - 2 * k * k * k);
+
+		limit += decay->backlog[k] * weight;
+	}
+
+	return limit / (steps * steps * steps);
+}
+
+/**
+ * Purges npages pages from start to the state to. Pages become muzzy
+ * with MADV_FREE, or clean with MADV_DONTNEED, which is also used where
+ * MADV_FREE is not supported.
+ * @return the state of the pages, or -1 if they could not be purged.
+ */
+int purge_pages(char *start, size_t npages, int to)
+{
+	size_t len = npages * getpagesize();
+	int state = to;
+
+	if (state == PURGE_MUZZY && madvise(start, len, MADV_FREE) != 0)
+		state = PURGE_CLEAN;
+
+	if (state == PURGE_CLEAN && madvise(start, len, MADV_DONTNEED) != 0)
+		return -1;
+
+	STATS_ADD(npurged, npages);
+	return state;
+}
+
+/**
+ * Purges at least npages pages of the free blocks of heap in state
+ * from, whole blocks at a time.
+ * @return the number of pages purged.
+ */
+size_t heap_purge(heap_t *heap, int from, int to, size_t npages)
+{
+	size_t purged = 0;
+
+	if (conf.block_table)
+		return block_table_purge(heap, from, to, npages);
+
+	for (block_meta_t *iterator = heap->head.next;
+		 iterator != &heap->head && purged < npages; iterator = iterator->next) {
+		if (iterator->status != STATUS_FREE || iterator->purge != from)
+			continue;
+
+		char *start;
+		size_t block_pages = free_block_pages(iterator, iterator->size, &start);
+		int state = block_pages ? purge_pages(start, block_pages, to) : -1;
+
+		if (state < 0)
+			continue;
+
+		iterator->purge = state;
+		purged += block_pages;
+	}
+
+	return purged;
+}
+
+/**
+ * Purges the pages of heap whose decay time elapsed.
+ */
+void heap_decay(heap_t *heap, void *arg)
+{
+	uint64_t now = *(uint64_t *)arg;
+	size_t npages[PURGE_STATES] = { 0 };
+	long decay_ms[] = { conf.dirty_decay_ms, conf.muzzy_decay_ms };
+
+	heap_count_pages(heap, npages);
+
+	for (int from = PURGE_DIRTY; from < PURGE_CLEAN; from++) {
+		struct decay *decay = &heap->decay[from];
+
+		if (decay_ms[from] < 0)
+			continue;
+
+		long limit = decay_limit(decay, npages[from], decay_ms[from], now);
+
+		if (limit < 0)
+			continue;
+
+		// Without a muzzy stage, dirty pages are dropped right away.
+		int to = (from == PURGE_DIRTY && conf.muzzy_decay_ms != 0) ? PURGE_MUZZY : PURGE_CLEAN;
+		size_t purged = 0;
+
+		if (npages[from] > (size_t)limit)
+			purged = heap_purge(heap, from, to, npages[from] - limit);
+
+		purged = purged < npages[from] ? purged : npages[from];
+		decay->nunpurged = npages[from] - purged;
+
+		if (to == PURGE_MUZZY)
+			npages[PURGE_MUZZY] += purged;
+	}
+}
+
+/**
+ * @return the time to sleep between two passes, a fraction of the
+ * shortest decay time.
+ */
+long decay_interval_ms(void)
+{
+	long interval = DECAY_INTERVAL_MAX_MS;
+	long decay_ms[] = { conf.dirty_decay_ms, conf.muzzy_decay_ms };
+
+	for (int i = 0; i < 2; i++) {
+		if (decay_ms[i] >= 0 && decay_ms[i] / DECAY_STEPS < interval)
+			interval = decay_ms[i] / DECAY_STEPS;
+	}
+
+	return interval < DECAY_INTERVAL_MIN_MS ? DECAY_INTERVAL_MIN_MS : interval;
+}
+
+void *decay_thread(void *arg)
+{
+	(void)arg;
+
+	while (1) {
+		long interval = decay_interval_ms();
+		struct timespec ts = {
+			.tv_sec = interval / 1000,
+			.tv_nsec = (interval % 1000) * 1000000,
+		};
+
+		nanosleep(&ts, NULL);
+
+		if (!conf.background_thread)
+			continue;
+
+		uint64_t now = decay_now_ms();
+
+		heaps_walk(heap_decay, &now);
+	}
+
+	return NULL;
+}
+
+/**
+ * Starts the purging thread on the first free after it was enabled.
+ */
+void decay_thread_start(void)
+{
+	if (__atomic_load_n(&decay_thread_state, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&decay_thread_lock);
+
+	if (decay_thread_state == 0) {
+		pthread_t thread;
+		pthread_attr_t attr;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		// Not retried on failure: the pages are then never purged.
+		if (pthread_create(&thread, &attr, decay_thread, NULL) == 0)
+			__atomic_store_n(&decay_thread_state, 1, __ATOMIC_RELEASE);
+		else
+			__atomic_store_n(&decay_thread_state, -1, __ATOMIC_RELEASE);
+
+		pthread_attr_destroy(&attr);
+	}
+
+	pthread_mutex_unlock(&decay_thread_lock);
+}
+
+/**
+ * Counts the pages of the free heap blocks of every heap in each
+ * purge state.
+ */
+void decay_count_pages(size_t npages[PURGE_STATES])
+{
+	heaps_walk(heap_count_pages, npages);
+}
+
+void decay_prefork(void)
+{
+	pthread_mutex_lock(&decay_thread_lock);
+}
+
+void decay_postfork_parent(void)
+{
+	pthread_mutex_unlock(&decay_thread_lock);
+}
+
+/**
+ * The purging thread does not exist in the child, it is started again
+ * on the next free.
+ */
+void decay_postfork_child(void)
+{
+	pthread_mutex_init(&decay_thread_lock, NULL);
+
+	if (decay_thread_state == 1)
+		decay_thread_state = 0;
+}
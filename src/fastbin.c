@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * With fastbins enabled, heap blocks of up to FASTBIN_MAX_SIZE bytes
+ * are not released when they are freed, but pushed on a LIFO list of
+ * their heap per payload size, linked through their first payload word.
+ * They are marked STATUS_FASTBIN, so they are neither merged nor found
+ * by the fit policies, and freeing them again is ignored. They are
+ * handed out again to requests of the same size without splitting
+ * anything, and released in bulk only when the heap has no block left
+ * for a request or a request of FASTBIN_CONSOLIDATE_SIZE comes.
+ */
+unsigned int fastbin_index(size_t size)
+{
+	return size / conf.alignment - 1;
+}
+
+/**
+ * Keeps the freed block for a later request of its size.
+ * @return 1 if the block was kept, 0 if it is too big.
+ */
+int fastbin_push(heap_t *heap, block_meta_t *block)
+{
+	if (block->size > FASTBIN_MAX_SIZE)
+		return 0;
+
+	block_meta_t **bin = &heap->fastbins[fastbin_index(block->size)];
+
+	block->status = STATUS_FASTBIN;
+	*(block_meta_t **)((char *)block + META_BLOCK_SIZE) = *bin;
+	*bin = block;
+	heap->fastbin_blocks++;
+
+	return 1;
+}
+
+/**
+ * @return the last freed block with a payload of size bytes, or NULL.
+ */
+block_meta_t *fastbin_pop(heap_t *heap, size_t size)
+{
+	if (size > FASTBIN_MAX_SIZE)
+		return NULL;
+
+	block_meta_t **bin = &heap->fastbins[fastbin_index(size)];
+	block_meta_t *block = *bin;
+
+	if (!block)
+		return NULL;
+
+	*bin = *(block_meta_t **)((char *)block + META_BLOCK_SIZE);
+	heap->fastbin_blocks--;
+	block->status = STATUS_ALLOC;
+
+	STATS_ADD(nfastbin_hit, 1);
+	return block;
+}
+
+/**
+ * Releases every block of the fastbins of heap, so they can be merged
+ * with their neighbours and used for any request.
+ */
+void fastbin_consolidate(heap_t *heap)
+{
+	for (int i = 0; i < FASTBIN_COUNT; i++) {
+		block_meta_t *block = heap->fastbins[i];
+
+		while (block) {
+			block_meta_t *next = *(block_meta_t **)((char *)block + META_BLOCK_SIZE);
+
+			release_heap_block(heap, block);
+			block = next;
+		}
+
+		heap->fastbins[i] = NULL;
+	}
+
+	heap->fastbin_blocks = 0;
+}
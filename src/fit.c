@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * Placement policies, selected with "fit" in OSMEM_CONF or
+ * os_mallopt(OS_M_FIT_POLICY). Each one returns a free heap block of at
+ * least size bytes, or NULL. The block list keeps the heap blocks in
+ * address order, so a walk from the head is address ordered. With
+ * block_table enabled, each policy scans the table of free blocks,
+ * which is in address order too, instead of the list.
+ */
+typedef block_meta_t *(*fit_policy_t)(heap_t *heap, size_t size);
+
+/**
+ * @return the first free block that fits, starting from the lowest
+ * address.
+ */
+block_meta_t *find_first_block(heap_t *heap, size_t size)
+{
+	if (conf.block_table)
+		return block_table_first_fit(heap, size);
+
+	block_meta_t *iterator = heap->head.next;
+
+	while (iterator != &heap->head) {
+		if (iterator->status == STATUS_FREE && iterator->size >= size)
+			return iterator;
+
+		iterator = iterator->next;
+	}
+
+	return NULL;
+}
+
+/**
+ * @return the first free block that fits, resuming the walk after the
+ * block handed out last and wrapping around the list once.
+ */
+block_meta_t *find_next_block(heap_t *heap, size_t size)
+{
+	if (conf.block_table)
+		return block_table_next_fit(heap, size);
+
+	block_meta_t *start = heap->rover ? heap->rover : &heap->head;
+	block_meta_t *iterator = start->next;
+
+	do {
+		if (iterator != &heap->head && iterator->status == STATUS_FREE &&
+			iterator->size >= size) {
+			heap->rover = iterator;
+			return iterator;
+		}
+
+		iterator = iterator->next;
+	} while (iterator != start->next);
+
+	return NULL;
+}
+
+/**
+ * Address ordered first fit.
+ * @return the free block that fits at the lowest address, looked up in
+ * the free tree if there is one. Otherwise the block list is walked as
+ * for first fit, since it is in address order.
+ */
+block_meta_t *find_address_block(heap_t *heap, size_t size)
+{
+	if (conf.free_tree)
+		return free_tree_lowest_fit(heap, size);
+
+	return find_first_block(heap, size);
+}
+
+/**
+ * Best fit with a bounded search: returns the first block wasting at
+ * most 1/GOOD_FIT_SLACK of size, or the best one among the first
+ * GOOD_FIT_CANDIDATES blocks that fit.
+ */
+block_meta_t *find_good_block(heap_t *heap, size_t size)
+{
+	if (conf.block_table)
+		return block_table_good_fit(heap, size);
+
+	block_meta_t *iterator = heap->head.next;
+	block_meta_t *best_fit = NULL;
+	unsigned int candidates = 0;
+
+	while (iterator != &heap->head && candidates < GOOD_FIT_CANDIDATES) {
+		if (iterator->status == STATUS_FREE && iterator->size >= size) {
+			if (iterator->size - size <= size / GOOD_FIT_SLACK)
+				return iterator;
+
+			if (!best_fit || iterator->size < best_fit->size)
+				best_fit = iterator;
+
+			candidates++;
+		}
+
+		iterator = iterator->next;
+	}
+
+	return best_fit;
+}
+
+const fit_policy_t fit_policies[] = {
+	[OS_FIT_BEST] = find_best_block,
+	[OS_FIT_FIRST] = find_first_block,
+	[OS_FIT_NEXT] = find_next_block,
+	[OS_FIT_ADDRESS] = find_address_block,
+	[OS_FIT_GOOD] = find_good_block,
+};
+
+/**
+ * Searches heap for a free block of at least size bytes, with the
+ * configured placement policy.
+ * @return the block, or NULL if none fits.
+ */
+block_meta_t *find_free_block(heap_t *heap, size_t size)
+{
+	return fit_policies[conf.fit_policy](heap, ALIGN(size));
+}
@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * With free_tree enabled, the free blocks of a heap are indexed in a
+ * treap ordered by (size, address), whose nodes live in the payloads of
+ * the free blocks. The priority of a node is a hash of its address, so
+ * the shape of the tree does not depend on the order of the updates and
+ * its depth stays logarithmic without storing any balance information.
+ * Each node also points to the lowest node of its subtree, so the lowest
+ * block of at least some size is found in logarithmic time too.
+ */
+struct free_node {
+	struct free_node *left;
+	struct free_node *right;
+	struct free_node *parent;
+	struct free_node *lowest;
+};
+
+#define NODE_OF(block) ((struct free_node *)((char *)(block) + META_BLOCK_SIZE))
+#define BLOCK_OF(node) ((block_meta_t *)((char *)(node) - META_BLOCK_SIZE))
+
+size_t free_node_priority(struct free_node *node)
+{
+	return ptr_hash(node, 0, 48);
+}
+
+/**
+ * @return 1 if node a orders before node b, by size then address.
+ */
+int free_node_before(struct free_node *a, struct free_node *b)
+{
+	size_t size_a = BLOCK_OF(a)->size;
+	size_t size_b = BLOCK_OF(b)->size;
+
+	if (size_a != size_b)
+		return size_a < size_b;
+
+	return a < b;
+}
+
+/**
+ * Recomputes the lowest node of the subtree of node from its children.
+ */
+void free_node_update(struct free_node *node)
+{
+	node->lowest = node;
+
+	if (node->left && node->left->lowest < node->lowest)
+		node->lowest = node->left->lowest;
+
+	if (node->right && node->right->lowest < node->lowest)
+		node->lowest = node->right->lowest;
+}
+
+/**
+ * Recomputes the lowest nodes from node up to the root.
+ */
+void free_node_update_up(struct free_node *node)
+{
+	for (; node; node = node->parent)
+		free_node_update(node);
+}
+
+/**
+ * Replaces the link from the parent of old to old with a link to new.
+ */
+void free_tree_relink(heap_t *heap, struct free_node *old, struct free_node *new)
+{
+	struct free_node *parent = old->parent;
+
+	if (!parent)
+		heap->free_tree = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+
+	if (new)
+		new->parent = parent;
+}
+
+/**
+ * Rotates node above its parent, keeping the order of the tree.
+ */
+void free_tree_rotate_up(heap_t *heap, struct free_node *node)
+{
+	struct free_node *parent = node->parent;
+
+	free_tree_relink(heap, parent, node);
+
+	if (parent->left == node) {
+		parent->left = node->right;
+		if (node->right)
+			node->right->parent = parent;
+		node->right = parent;
+	} else {
+		parent->right = node->left;
+		if (node->left)
+			node->left->parent = parent;
+		node->left = parent;
+	}
+
+	parent->parent = node;
+
+	// The subtree keeps its nodes, so only the two rotated ones change.
+	free_node_update(parent);
+	free_node_update(node);
+}
+
+/**
+ * Indexes the free block. Its payload must be at least FREE_NODE_SIZE.
+ */
+void free_tree_insert(heap_t *heap, block_meta_t *block)
+{
+	struct free_node *node = NODE_OF(block);
+	struct free_node **link = &heap->free_tree;
+	struct free_node *parent = NULL;
+
+	while (*link) {
+		parent = *link;
+		link = free_node_before(node, parent) ? &parent->left : &parent->right;
+	}
+
+	node->left = NULL;
+	node->right = NULL;
+	node->parent = parent;
+	*link = node;
+	free_node_update_up(node);
+
+	while (node->parent && free_node_priority(node) > free_node_priority(node->parent))
+		free_tree_rotate_up(heap, node);
+}
+
+/**
+ * Removes the free block from the index, rotating it down to a leaf.
+ */
+void free_tree_remove(heap_t *heap, block_meta_t *block)
+{
+	struct free_node *node = NODE_OF(block);
+
+	while (node->left && node->right) {
+		if (free_node_priority(node->left) > free_node_priority(node->right))
+			free_tree_rotate_up(heap, node->left);
+		else
+			free_tree_rotate_up(heap, node->right);
+	}
+
+	free_tree_relink(heap, node, node->left ? node->left : node->right);
+	free_node_update_up(node->parent);
+}
+
+/**
+ * @return the smallest free block of at least size bytes, the lowest
+ * one on ties, or NULL if there is none.
+ */
+block_meta_t *free_tree_best_fit(heap_t *heap, size_t size)
+{
+	struct free_node *node = heap->free_tree;
+	struct free_node *best = NULL;
+
+	while (node) {
+		if (BLOCK_OF(node)->size >= size) {
+			best = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	return best ? BLOCK_OF(best) : NULL;
+}
+
+/**
+ * @return the free block of at least size bytes at the lowest address,
+ * or NULL if there is none. A node that fits, and its whole right
+ * subtree, fit, so only its left subtree is searched further.
+ */
+block_meta_t *free_tree_lowest_fit(heap_t *heap, size_t size)
+{
+	struct free_node *node = heap->free_tree;
+	struct free_node *lowest = NULL;
+
+	while (node) {
+		if (BLOCK_OF(node)->size >= size) {
+			if (!lowest || node < lowest)
+				lowest = node;
+
+			if (node->right && node->right->lowest < lowest)
+				lowest = node->right->lowest;
+
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	return lowest ? BLOCK_OF(lowest) : NULL;
+}
@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * With grow_streak set, each heap remembers the last blocks resized by
+ * os_realloc() in a small table keyed by address, with the size last
+ * requested for them and how many times in a row they grew. Once a
+ * block grew grow_streak times in a row, it is given as much headroom
+ * as it asked for, so appending to a buffer moves it a logarithmic
+ * number of times instead of on nearly every call. The table is set
+ * associative: a block may take any slot of its set, and evicts the one
+ * resized least recently, so a few buffers growing together do not keep
+ * resetting each other's streaks.
+ */
+unsigned int grow_hash(block_meta_t *block)
+{
+	return ptr_hash(block, 4, GROW_HASH_BITS);
+}
+
+/**
+ * Looks up the slot of block, marking it as the most recently used.
+ * With create set, a missing block takes the free or least recently
+ * used slot of its set, with an empty streak.
+ * @return the slot, or NULL if block has none and create is not set.
+ */
+struct grow_slot *grow_slot_of(heap_t *heap, block_meta_t *block, int create)
+{
+	struct grow_slot *set = heap->grow[grow_hash(block)];
+	struct grow_slot *victim = &set[0];
+
+	for (int i = 0; i < GROW_WAYS; i++) {
+		if (set[i].block == block) {
+			set[i].used = ++heap->grow_clock;
+			return &set[i];
+		}
+
+		if (victim->block && (!set[i].block || set[i].used < victim->used))
+			victim = &set[i];
+	}
+
+	if (!create)
+		return NULL;
+
+	victim->block = block;
+	victim->size = block->size;
+	victim->streak = 0;
+	victim->used = ++heap->grow_clock;
+
+	return victim;
+}
+
+/**
+ * Forgets the growth of block, when it is freed.
+ */
+void growth_forget(heap_t *heap, block_meta_t *block)
+{
+	struct grow_slot *slot = grow_slot_of(heap, block, 0);
+
+	if (slot)
+		slot->block = NULL;
+}
+
+/**
+ * Resizes a growing block with headroom. Blocks that shrink, or did
+ * not grow often enough yet, are left to the plain resize.
+ * @return 1 if the block was resized, with the payload or NULL in
+ * *result, 0 otherwise.
+ */
+int growth_realloc(heap_t *heap, block_meta_t *block, size_t size, void **result)
+{
+	struct grow_slot *slot = grow_slot_of(heap, block, 1);
+	void *payload = (char *)block + META_BLOCK_SIZE;
+
+	if (size <= slot->size) {
+		// The headroom is given back by the plain shrink.
+		slot->size = size;
+		slot->streak = 0;
+		return 0;
+	}
+
+	slot->size = size;
+	if (++slot->streak < conf.grow_streak)
+		return 0;
+
+	if (size <= block->size) {
+		*result = payload;
+		return 1;
+	}
+
+	size_t reserve = ALIGN(2 * size);
+
+	if (heap_expand(heap, payload, size, reserve)) {
+		*result = payload;
+		return 1;
+	}
+
+	*result = extend_realloc(heap, block, reserve);
+	if (!*result)
+		return 1;
+
+	block_meta_t *new_block = (block_meta_t *)((char *)*result - META_BLOCK_SIZE);
+	unsigned int streak = slot->streak;
+
+	slot->block = NULL;
+	slot = grow_slot_of(heap, new_block, 1);
+	slot->size = size;
+	slot->streak = streak;
+
+	STATS_ADD(ngrow_reserve, 1);
+	return 1;
+}
@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+// Heaps created with os_heap_create(), linked for the fork() handlers.
+heap_t *user_heaps;
+pthread_mutex_t user_heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Creates a heap with its own block list and reserved range. Its blocks
+ * are only reachable through the os_heap_* functions, so the heap can
+ * be destroyed at once without walking them.
+ * @return the new heap, or NULL on failure.
+ */
+os_heap_t *os_heap_create(void)
+{
+	if (!head_init_done)
+		head_init();
+
+	heap_t *heap = os_malloc(sizeof(heap_t));
+
+	if (!heap)
+		return NULL;
+
+	heap_init(heap, HEAP_ID_USER);
+
+	if (!vm_heap_reserve(heap, ARENA_RESERVE_SIZE)) {
+		pthread_mutex_destroy(&heap->lock);
+		os_free(heap);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&user_heaps_lock);
+	heap->next = user_heaps;
+	user_heaps = heap;
+	pthread_mutex_unlock(&user_heaps_lock);
+
+	return heap;
+}
+
+void *os_heap_malloc(os_heap_t *heap, size_t size)
+{
+	if (!heap || size == 0)
+		return NULL;
+
+	STATS_ADD(nmalloc, 1);
+
+	heap_lock(heap);
+	void *result = heap_malloc(heap, size);
+
+	heap_unlock(heap);
+
+	return result;
+}
+
+void os_heap_free(os_heap_t *heap, void *ptr)
+{
+	if (!heap || !ptr)
+		return;
+
+	STATS_ADD(nfree, 1);
+
+	heap_lock(heap);
+	heap_free(heap, ptr);
+	heap_unlock(heap);
+}
+
+void *os_heap_realloc(os_heap_t *heap, void *ptr, size_t size)
+{
+	if (!heap)
+		return NULL;
+
+	if (ptr == NULL)
+		return os_heap_malloc(heap, size);
+
+	if (size == 0) {
+		os_heap_free(heap, ptr);
+		return NULL;
+	}
+
+	STATS_ADD(nrealloc, 1);
+
+	heap_lock(heap);
+	void *result = heap_realloc(heap, ptr, size);
+
+	heap_unlock(heap);
+
+	return result;
+}
+
+/**
+ * Unmaps the mapped blocks of heap, then its whole reserved range,
+ * without looking at the blocks allocated inside it.
+ */
+void os_heap_destroy(os_heap_t *heap)
+{
+	if (!heap)
+		return;
+
+	pthread_mutex_lock(&user_heaps_lock);
+
+	heap_t **iterator = &user_heaps;
+
+	while (*iterator && *iterator != heap)
+		iterator = &(*iterator)->next;
+
+	if (*iterator)
+		*iterator = heap->next;
+
+	pthread_mutex_unlock(&user_heaps_lock);
+
+	mapped_destroy(heap);
+
+	DIE(munmap(heap->base, heap->reserve_end - heap->base) == -1,
+		"Critical error: munmap() failed.\n");
+
+	STATS_ADD(nmunmap, 1);
+	STATS_SUB(heap_size, heap->end - heap->base);
+
+	start_map_destroy(heap);
+	block_table_destroy(heap);
+
+	pthread_mutex_destroy(&heap->lock);
+	os_free(heap);
+}
+
+void user_heaps_prefork(void)
+{
+	pthread_mutex_lock(&user_heaps_lock);
+
+	for (heap_t *heap = user_heaps; heap; heap = heap->next)
+		pthread_mutex_lock(&heap->lock);
+}
+
+void user_heaps_postfork_parent(void)
+{
+	for (heap_t *heap = user_heaps; heap; heap = heap->next)
+		pthread_mutex_unlock(&heap->lock);
+
+	pthread_mutex_unlock(&user_heaps_lock);
+}
+
+void user_heaps_postfork_child(void)
+{
+	for (heap_t *heap = user_heaps; heap; heap = heap->next)
+		pthread_mutex_init(&heap->lock, NULL);
+
+	pthread_mutex_init(&user_heaps_lock, NULL);
+}
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * With map_headroom set, mapped blocks are followed by map_headroom
+ * bytes of PROT_NONE address space, so os_realloc() grows them in place
+ * with mprotect() instead of mapping a new block and copying. The size
+ * of the whole reservation is stored in a word before the block header,
+ * so these blocks are the only mapped blocks not starting on a page.
+ */
+#define MAP_RESERVE_PREFIX ALIGN(sizeof(size_t))
+
+size_t *map_reserve_size(block_meta_t *block)
+{
+	return (size_t *)((char *)block - MAP_RESERVE_PREFIX);
+}
+
+/**
+ * @return 1 if block was mapped with headroom, 0 otherwise.
+ */
+int map_reserved(block_meta_t *block)
+{
+	return ((uintptr_t)block & (getpagesize() - 1)) != 0;
+}
+
+/**
+ * @return the end of the writable pages of a block mapped with
+ * headroom holding size bytes.
+ */
+uintptr_t map_reserve_commit_end(block_meta_t *block, size_t size)
+{
+	uintptr_t page_size = getpagesize();
+
+	return ((uintptr_t)block + META_BLOCK_SIZE + size + page_size - 1) & ~(page_size - 1);
+}
+
+/**
+ * Reserves the address space for a block of size bytes and its
+ * headroom, and commits the pages of the block.
+ * @return the block, or MAP_FAILED.
+ */
+block_meta_t *map_reserve(size_t size)
+{
+	size_t page_size = getpagesize();
+	size_t commit_size = (MAP_RESERVE_PREFIX + META_BLOCK_SIZE + size + page_size - 1) &
+						 ~(page_size - 1);
+	size_t reserve_size = commit_size + ((conf.map_headroom + page_size - 1) & ~(page_size - 1));
+	char *start = mmap(NULL, reserve_size, PROT_NONE,
+					   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (start == MAP_FAILED)
+		return MAP_FAILED;
+
+	STATS_ADD(nmmap, 1);
+
+	if (mprotect(start, commit_size, PROT_READ | PROT_WRITE) != 0) {
+		DIE(munmap(start, reserve_size) == -1, "Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+		return MAP_FAILED;
+	}
+
+	block_meta_t *block = (block_meta_t *)(start + MAP_RESERVE_PREFIX);
+
+	*map_reserve_size(block) = reserve_size;
+	return block;
+}
+
+/**
+ * Grows a block mapped with headroom to size bytes, committing the
+ * pages of the headroom it reaches.
+ * @return 1 for success, 0 if the block has no headroom or not enough.
+ */
+int map_reserve_grow(block_meta_t *block, size_t size)
+{
+	if (!map_reserved(block))
+		return 0;
+
+	uintptr_t reserve_end = (uintptr_t)block - MAP_RESERVE_PREFIX + *map_reserve_size(block);
+	uintptr_t commit_end = map_reserve_commit_end(block, block->size);
+	uintptr_t new_commit_end = map_reserve_commit_end(block, size);
+
+	if (new_commit_end > reserve_end)
+		return 0;
+
+	if (new_commit_end > commit_end &&
+		mprotect((void *)commit_end, new_commit_end - commit_end, PROT_READ | PROT_WRITE) != 0)
+		return 0;
+
+	STATS_ADD(mapped_size, size - block->size);
+	block->size = size;
+	return 1;
+}
+
+/**
+ * Shrinks a block mapped with headroom to size bytes, releasing the
+ * pages past its new end along with the rest of the headroom.
+ */
+void map_reserve_shrink(block_meta_t *block, size_t size)
+{
+	char *start = (char *)block - MAP_RESERVE_PREFIX;
+	char *reserve_end = start + *map_reserve_size(block);
+	char *new_end = (char *)map_reserve_commit_end(block, size);
+
+	if (new_end < reserve_end) {
+		DIE(munmap(new_end, reserve_end - new_end) == -1,
+			"Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+	}
+
+	*map_reserve_size(block) = new_end - start;
+
+	STATS_SUB(mapped_size, block->size - size);
+	block->size = size;
+}
+
+/**
+ * Releases a block mapped with headroom, with its headroom.
+ */
+void map_reserve_release(block_meta_t *block)
+{
+	release_mapping((char *)block - MAP_RESERVE_PREFIX, *map_reserve_size(block));
+}
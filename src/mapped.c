@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * Mapped blocks are not kept in the block list of their heap, but in a
+ * hash table of the heap keyed by address, so walks of the heap blocks
+ * never see them. Each bucket is a doubly linked list through the prev
+ * and next fields of the blocks, NULL terminated at both ends. The table
+ * doubles whenever it holds more blocks than buckets, so the lists stay
+ * short however many blocks a heap maps.
+ */
+unsigned int mapped_hash(heap_t *heap, block_meta_t *block)
+{
+	return ptr_hash(block, 12, heap->mapped_bits);
+}
+
+void mapped_link(heap_t *heap, block_meta_t *block)
+{
+	block_meta_t **bucket = &heap->mapped[mapped_hash(heap, block)];
+
+	block->prev = NULL;
+	block->next = *bucket;
+	if (*bucket)
+		(*bucket)->prev = block;
+	*bucket = block;
+}
+
+/**
+ * Moves the blocks of heap to a table with twice the buckets. If it can
+ * not be mapped, the blocks stay in the current one.
+ */
+void mapped_grow(heap_t *heap)
+{
+	block_meta_t **old = heap->mapped;
+	size_t old_buckets = 1UL << heap->mapped_bits;
+	block_meta_t **table = mmap(NULL, 2 * old_buckets * sizeof(*table), PROT_READ | PROT_WRITE,
+								MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (table == MAP_FAILED)
+		return;
+
+	STATS_ADD(nmmap, 1);
+
+	heap->mapped = table;
+	heap->mapped_bits++;
+
+	for (size_t i = 0; i < old_buckets; i++) {
+		while (old[i]) {
+			block_meta_t *block = old[i];
+
+			old[i] = block->next;
+			mapped_link(heap, block);
+		}
+	}
+
+	if (old != heap->mapped_inline) {
+		DIE(munmap(old, old_buckets * sizeof(*old)) == -1,
+			"Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+	}
+}
+
+void mapped_insert(heap_t *heap, block_meta_t *block)
+{
+	if (heap->mapped_count >= 1UL << heap->mapped_bits)
+		mapped_grow(heap);
+
+	mapped_link(heap, block);
+	heap->mapped_count++;
+
+	block->arena = heap->id;
+}
+
+void mapped_remove(heap_t *heap, block_meta_t *block)
+{
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		heap->mapped[mapped_hash(heap, block)] = block->next;
+
+	if (block->next)
+		block->next->prev = block->prev;
+
+	heap->mapped_count--;
+}
+
+/**
+ * @return the mapped block of heap whose payload is ptr, or NULL.
+ */
+block_meta_t *mapped_lookup(heap_t *heap, void *ptr)
+{
+	block_meta_t *block = (block_meta_t *)((char *)ptr - META_BLOCK_SIZE);
+	block_meta_t *iterator = heap->mapped[mapped_hash(heap, block)];
+
+	while (iterator && iterator != block)
+		iterator = iterator->next;
+
+	return iterator;
+}
+
+/**
+ * Unmaps every mapped block of heap, then the table if it grew.
+ */
+void mapped_destroy(heap_t *heap)
+{
+	size_t buckets = 1UL << heap->mapped_bits;
+
+	for (size_t i = 0; i < buckets; i++) {
+		while (heap->mapped[i])
+			delete_mapped_block(heap, heap->mapped[i]);
+	}
+
+	if (heap->mapped != heap->mapped_inline) {
+		DIE(munmap(heap->mapped, buckets * sizeof(*heap->mapped)) == -1,
+			"Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+	}
+
+	heap->mapped = heap->mapped_inline;
+	heap->mapped_bits = MAPPED_HASH_BITS;
+}
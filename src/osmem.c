@@ -2,34 +2,83 @@
 
 #include "utils_src.h"
 
-block_meta_t head;
 int head_init_done;
-int heap_prealloc_done;
+pthread_once_t head_init_once = PTHREAD_ONCE_INIT;
 
 /**
  * Initialize the head of the circular list. The head will be a permanent,
  * free block, without a payload. It will only serve as the starting point
  * for any traversal of the list.
  */
+void heap_init(heap_t *heap, unsigned short id)
+{
+	heap->head.size = 0;
+	heap->head.status = STATUS_FREE;
+	heap->head.prev = &heap->head;
+	heap->head.next = &heap->head;
+	heap->id = id;
+	heap->prealloc_done = 0;
+	heap->remote_frees = NULL;
+	heap->free_tree = NULL;
+	heap->block_table = NULL;
+	heap->block_table_len = 0;
+	heap->block_table_cap = 0;
+	heap->rover = NULL;
+	heap->start_map = NULL;
+	memset(heap->mapped_inline, 0, sizeof(heap->mapped_inline));
+	heap->mapped = heap->mapped_inline;
+	heap->mapped_bits = MAPPED_HASH_BITS;
+	heap->mapped_count = 0;
+	memset(heap->decay, 0, sizeof(heap->decay));
+	memset(heap->grow, 0, sizeof(heap->grow));
+	heap->grow_clock = 0;
+	memset(heap->fastbins, 0, sizeof(heap->fastbins));
+	heap->fastbin_blocks = 0;
+	pthread_mutex_init(&heap->lock, NULL);
+}
+
+void head_init_routine(void)
+{
+	conf_init();
+
+	// Free blocks are indexed in one place only, the tree if both are set.
+	if (conf.free_tree)
+		conf.block_table = 0;
+
+	heap_init(main_heap, 0);
+
+	// Without a reserved range, the main heap falls back to sbrk().
+	if (conf.vm_heap)
+		vm_heap_reserve(main_heap, conf.vm_heap);
+
+	arena_nr = 1;
+	pthread_atfork(osmem_prefork, osmem_postfork_parent, osmem_postfork_child);
+	__atomic_store_n(&head_init_done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Initializes the main heap. The configuration is read here,
+ * as this is the first use of the allocator.
+ */
 void head_init(void)
 {
-	head.size = 0;
-	head.prev = &head;
-	head.next = &head;
-	head_init_done = 1;
+	pthread_once(&head_init_once, head_init_routine);
 }
 
 /**
  * Adds block to the end of the linked list.
  */
-void list_add_last(block_meta_t *block)
+void list_add_last(heap_t *heap, block_meta_t *block)
 {
-	block_meta_t *last = head.prev;
+	block_meta_t *last = heap->head.prev;
 
 	last->next = block;
 	block->prev = last;
-	block->next = &head;
-	head.prev = block;
+	block->next = &heap->head;
+	heap->head.prev = block;
+	block->arena = heap->id;
+
+	start_map_mark(heap, block, 1);
 }
 
 /**
@@ -42,37 +91,111 @@ void list_remove_block(block_meta_t *block)
 }
 
 /**
- * Maps memory using mmap() and adds the newly created block to the list.
+ * Maps memory using mmap() and adds the newly created block to the
+ * registry of mapped blocks.
  * @return the new block's address.
  */
-block_meta_t *map_block_in_mem(size_t size)
+block_meta_t *map_block_in_mem(heap_t *heap, size_t size)
 {
 	size_t requested_size = (META_BLOCK_SIZE + size);
-	block_meta_t *block = mmap(NULL, requested_size, PROT_READ | PROT_WRITE,
-								MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	block_meta_t *block;
+
+	if (conf.thp && requested_size >= HUGE_PAGE_SIZE) {
+		block = thp_map(requested_size);
+	} else if (conf.map_headroom && conf.alignment < (size_t)getpagesize()) {
+		block = map_reserve(size);
+	} else {
+		block = mmap(NULL, requested_size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block != MAP_FAILED)
+			STATS_ADD(nmmap, 1);
+	}
 
 	if (block == MAP_FAILED)
 		return NULL;
 
+	STATS_ADD(mapped_size, requested_size);
+
 	block->size = size;
 	block->status = STATUS_MAPPED;
-	list_add_last(block);
+	mapped_insert(heap, block);
 
 	return block;
 }
 
+/**
+ * Grows the mapping ending at end by len bytes in place, mapping the
+ * pages right after it if nothing else uses them.
+ * @return 1 for success, 0 otherwise.
+ */
+int mapping_grow(void *end, size_t len)
+{
+	void *ret = mmap(end, len, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+	if (ret == MAP_FAILED)
+		return 0;
+
+	STATS_ADD(nmmap, 1);
+
+	// Kernels older than 4.17 take the address as a hint only.
+	if (ret != end) {
+		DIE(munmap(ret, len) == -1, "Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Grows the heap by increment bytes, using sbrk() for the main heap
+ * and committing reserved pages for the others, or for the main heap
+ * too if it has a reserved range.
+ * @return the previous end of the heap, or (void *) -1 on failure.
+ */
+void *heap_grow(heap_t *heap, size_t increment)
+{
+	if (heap->base)
+		return vm_heap_grow(heap, increment);
+
+	void *old_end = sbrk(increment);
+
+	if (old_end == (void *) -1)
+		return old_end;
+
+	STATS_ADD(nsbrk, 1);
+	STATS_ADD(heap_size, increment);
+
+	if (conf.thp)
+		thp_advise_heap((char *)old_end + increment);
+
+	return old_end;
+}
+
 /**
  * Attempts to do the Heap Preallocation if it had not
  * already been done.
+ * With transparent huge pages enabled, the heap starts on a huge page
+ * boundary and the preallocation is rounded up to whole huge pages.
  * @return 1 for success, 0 otherwise.
  */
-int prealloc_heap_attempt(void)
+int prealloc_heap_attempt(heap_t *heap)
 {
-	if (heap_prealloc_done != 0)
+	if (heap->prealloc_done != 0)
 		return 1;
 
+	size_t prealloc_size = conf.prealloc_size;
+
+	if (conf.thp && !heap->base) {
+		if (!thp_align_heap_start())
+			return 0;
+
+		prealloc_size = HUGE_ALIGN(prealloc_size);
+	}
+
 	// Try to do the Heap Preallocation
-	void *request_block = sbrk(HEAP_PREALLOC_SIZE);
+	void *request_block = heap_grow(heap, prealloc_size);
 
 	// Check if sbrk failed.
 	if (request_block == (void *) -1)
@@ -80,12 +203,14 @@ int prealloc_heap_attempt(void)
 
 	block_meta_t *prealloc_block = (block_meta_t *)request_block;
 
-	prealloc_block->size = HEAP_PREALLOC_SIZE - META_BLOCK_SIZE;
+	prealloc_block->size = prealloc_size - META_BLOCK_SIZE;
 	prealloc_block->status = STATUS_FREE;
+	prealloc_block->purge = PURGE_CLEAN;
 
-	list_add_last(prealloc_block);
+	list_add_last(heap, prealloc_block);
+	free_index_insert(heap, prealloc_block);
 
-	heap_prealloc_done = 1;
+	heap->prealloc_done = 1;
 
 	return 1;
 }
@@ -95,12 +220,18 @@ int prealloc_heap_attempt(void)
  * the size requested.
  * @return start adress of the best fit block, if it exists, NULL, otherwise.
  */
-block_meta_t *find_best_block(size_t size)
+block_meta_t *find_best_block(heap_t *heap, size_t size)
 {
-	block_meta_t *iterator = head.next;
+	if (conf.free_tree)
+		return free_tree_best_fit(heap, ALIGN(size));
+
+	if (conf.block_table)
+		return block_table_best_fit(heap, ALIGN(size));
+
+	block_meta_t *iterator = heap->head.next;
 	block_meta_t *best_fit = NULL;
 
-	while (iterator != &head) {
+	while (iterator != &heap->head) {
 		if (iterator->status == STATUS_FREE && iterator->size >= ALIGN(size)) {
 			if (!best_fit || iterator->size < best_fit->size)
 				best_fit = iterator;
@@ -118,14 +249,18 @@ block_meta_t *find_best_block(size_t size)
  * Does not change the address block points to, so
  * it can be used freely afterwards.
  */
-void split_block_attempt(block_meta_t *block, size_t size)
+void split_block_attempt(heap_t *heap, block_meta_t *block, size_t size)
 {
-	if (block->size == ALIGN(size))
+	size = block_payload_size(size);
+
+	if (block->size == size)
 		return;
 
 	// If split happens, payload of @block would be occupied by the requested
-	// size and a new block_meta_t structure and at least 1 free byte.
-	size_t minimum_occupied_size = ALIGN(size) + META_BLOCK_SIZE + 1;
+	// size and a new block_meta_t structure and at least 1 free byte, or
+	// a whole tree node if free blocks are indexed.
+	size_t minimum_occupied_size = size + META_BLOCK_SIZE +
+								   (conf.free_tree ? FREE_NODE_SIZE - 1 : 1);
 
 	if (minimum_occupied_size >= block->size) {
 		// No split is performed.
@@ -133,51 +268,217 @@ void split_block_attempt(block_meta_t *block, size_t size)
 	}
 
 	block_meta_t *new_block = (block_meta_t *)((char *)block + META_BLOCK_SIZE
-								+ ALIGN(size));
+								+ size);
 
-	new_block->size = block->size - ALIGN(size) - META_BLOCK_SIZE;
-	new_block->status = STATUS_FREE;
+	new_block->size = block->size - size - META_BLOCK_SIZE;
+	new_block->arena = block->arena;
+	new_block->purge = block->purge;
 
-	block->size = ALIGN(size);
+	block->size = size;
 
 	// Add new block in the list.
 	new_block->next = block->next;
 	new_block->prev = block;
 	block->next->prev = new_block;
 	block->next = new_block;
+
+	start_map_mark(heap, new_block, 1);
+	release_heap_block(heap, new_block);
 }
 
 /**
- * Expands the last block.
+ * @return the payload size of a heap block holding size bytes. With
+ * the free tree, every block must be able to hold a tree node once
+ * it is freed.
+ */
+size_t block_payload_size(size_t size)
+{
+	size = ALIGN(size);
+
+	if (conf.free_tree && size < FREE_NODE_SIZE)
+		return FREE_NODE_SIZE;
+
+	return size;
+}
+
+/**
+ * @return the heap block before block in memory, or NULL.
+ */
+block_meta_t *prev_heap_block(heap_t *heap, block_meta_t *block)
+{
+	return block->prev == &heap->head ? NULL : block->prev;
+}
+
+/**
+ * @return the heap block after block in memory, or NULL.
+ */
+block_meta_t *next_heap_block(heap_t *heap, block_meta_t *block)
+{
+	return block->next == &heap->head ? NULL : block->next;
+}
+
+/**
+ * Indexes the free block, in the free tree or the block table, if
+ * either is enabled.
+ */
+void free_index_insert(heap_t *heap, block_meta_t *block)
+{
+	if (conf.free_tree)
+		free_tree_insert(heap, block);
+	else if (conf.block_table)
+		block_table_insert(heap, block);
+}
+
+/**
+ * Removes the free block from its index, if any.
+ */
+void free_index_remove(heap_t *heap, block_meta_t *block)
+{
+	if (conf.free_tree)
+		free_tree_remove(heap, block);
+	else if (conf.block_table)
+		block_table_remove(heap, block);
+}
+
+/**
+ * Marks a heap block free. With the free tree or the block table, the
+ * block is merged with its free neighbours right away and indexed, so
+ * the heap never has to be swept for adjacent free blocks.
+ */
+void release_heap_block(heap_t *heap, block_meta_t *block)
+{
+	block->status = STATUS_FREE;
+
+	// The table finds the free neighbours without reading their headers.
+	if (conf.block_table) {
+		block_table_release(heap, block);
+		return;
+	}
+
+	if (!conf.free_tree)
+		return;
+
+	block_meta_t *prev = prev_heap_block(heap, block);
+
+	if (prev && prev->status == STATUS_FREE) {
+		free_tree_remove(heap, prev);
+		coalesce_blocks(heap, prev, block);
+		block = prev;
+	}
+
+	block_meta_t *next = next_heap_block(heap, block);
+
+	if (next && next->status == STATUS_FREE) {
+		free_tree_remove(heap, next);
+		coalesce_blocks(heap, block, next);
+	}
+
+	free_tree_insert(heap, block);
+}
+
+/**
+ * Something else, e.g. the libc malloc of another thread, may move the
+ * program break, so the sbrk() heap does not always end at its break.
+ * @return 1 if the break is no longer right after the last block of
+ * heap, 0 otherwise.
+ */
+int heap_break_moved(heap_t *heap)
+{
+	block_meta_t *last_block = get_last_on_heap(heap);
+
+	if (heap->base || !last_block)
+		return 0;
+
+	return sbrk(0) != (char *)last_block + META_BLOCK_SIZE + last_block->size;
+}
+
+/**
+ * Expands the last block, if the heap can grow right after it.
  * @return the extended last block, in case of success, NULL, otherwise.
  */
-block_meta_t *expand_last_block(size_t size)
+block_meta_t *expand_last_block(heap_t *heap, size_t size)
 {
-	block_meta_t *last_block = get_last_on_heap();
+	block_meta_t *last_block = get_last_on_heap(heap);
 
-	if (!last_block)
+	if (!last_block || heap_break_moved(heap))
 		return NULL;
 
 	size_t additional_needed_size = size - last_block->size;
 
 	void *heap_end = (char *)last_block + META_BLOCK_SIZE + last_block->size;
+	void *old_end = heap_grow(heap, additional_needed_size);
 
-	heap_end = sbrk(additional_needed_size);
-	if (heap_end == (void *) -1)
+	// If the break moved since it was checked, the memory just taken
+	// is not next to the block and is left unused.
+	if (old_end == (void *) -1 || old_end != heap_end)
 		return NULL;
 
 	last_block->size += additional_needed_size;
 	return last_block;
 }
 
+/**
+ * Grows the heap by a new last block of size bytes. If the program
+ * break moved away from the end of the sbrk() heap, the new block is
+ * put after an empty allocated block, which keeps the blocks on both
+ * sides of the gap from being merged over memory the heap does not own.
+ * @return the new block, or NULL on failure.
+ */
+block_meta_t *heap_add_block(heap_t *heap, size_t size)
+{
+	block_meta_t *last_block = get_last_on_heap(heap);
+	char *heap_end = last_block ? (char *)last_block + META_BLOCK_SIZE + last_block->size : NULL;
+	size_t fence_size = heap_break_moved(heap) ? META_BLOCK_SIZE : 0;
+	char *request_block = heap_grow(heap, fence_size + META_BLOCK_SIZE + size);
+
+	if (request_block == (void *) -1)
+		return NULL;
+
+	// The break moved since it was checked, so the whole new memory
+	// becomes the fence and the block is taken after it.
+	int lost_race = !fence_size && !heap->base && heap_end && request_block != heap_end;
+
+	if (fence_size || lost_race) {
+		block_meta_t *fence = (block_meta_t *)request_block;
+
+		fence->size = lost_race ? size : 0;
+		fence->status = STATUS_ALLOC;
+		fence->purge = PURGE_DIRTY;
+		list_add_last(heap, fence);
+
+		if (lost_race)
+			return heap_add_block(heap, size);
+
+		request_block += META_BLOCK_SIZE;
+	}
+
+	block_meta_t *new_block = (block_meta_t *)request_block;
+
+	new_block->size = size;
+	new_block->purge = PURGE_DIRTY;
+
+	list_add_last(heap, new_block);
+
+	return new_block;
+}
+
 /**
  * Coalesces two blocks, merging them into block1,
  * while removing block2 from the list.
  */
-void coalesce_blocks(block_meta_t *block1, block_meta_t *block2)
+void coalesce_blocks(heap_t *heap, block_meta_t *block1, block_meta_t *block2)
 {
 	block1->size += META_BLOCK_SIZE + block2->size;
+
+	// The pages of the merged block are as dirty as the dirtiest ones.
+	if (block2->purge < block1->purge)
+		block1->purge = block2->purge;
+
 	list_remove_block(block2);
+	start_map_mark(heap, block2, 0);
+
+	if (heap->rover == block2)
+		heap->rover = block1;
 }
 
 /**
@@ -185,26 +486,24 @@ void coalesce_blocks(block_meta_t *block1, block_meta_t *block2)
  * If such blocks are found, they are coalesced into one bigger block.
  * The coalescing is done progressively on two blocks at a time.
  */
-void coalesce_attempt(void)
+void coalesce_attempt(heap_t *heap)
 {
-	block_meta_t *iterator = head.next;
+	// Indexed free blocks are merged when they are freed.
+	if (conf.free_tree || conf.block_table)
+		return;
+
+	block_meta_t *iterator = heap->head.next;
 	block_meta_t *to_coalesce1 = NULL;
 	block_meta_t *to_coalesce2 = NULL;
 
-	while (iterator != &head) {
-		if (iterator->status == STATUS_ALLOC) {
+	while (iterator != &heap->head) {
+		if (iterator->status != STATUS_FREE) {
 			to_coalesce1 = NULL;
 			to_coalesce2 = NULL;
 			iterator = iterator->next;
 			continue;
 		}
 
-		// Skip mapped blocks.
-		if (iterator->status == STATUS_MAPPED) {
-			iterator = iterator->next;
-			continue;
-		}
-
 		// Iterator surely points to a free block.
 		if (to_coalesce1 == NULL) {
 			to_coalesce1 = iterator;
@@ -217,20 +516,32 @@ void coalesce_attempt(void)
 		// Before coalescing the blocks, prepare iterator for the next step.
 		iterator = iterator->next;
 
-		coalesce_blocks(to_coalesce1, to_coalesce2);
+		coalesce_blocks(heap, to_coalesce1, to_coalesce2);
 	}
 }
 
 /**
- * Traverses the list, searching for a block whose payload's start
- * address is ptr.
+ * Searches the registry of mapped blocks, then the table of block
+ * starts or the list, for a block whose payload's start address is ptr.
  * @return the block, if existing, NULL, otherwise.
  */
-block_meta_t *search_block_in_list(void *ptr)
+block_meta_t *search_block_in_list(heap_t *heap, void *ptr)
 {
-	block_meta_t *iterator = head.next;
+	block_meta_t *mapped = mapped_lookup(heap, ptr);
+
+	if (mapped)
+		return mapped;
+
+	if (heap->start_map) {
+		if ((char *)ptr < heap->base || (char *)ptr >= heap->end)
+			return NULL;
+
+		return start_map_lookup(heap, ptr);
+	}
 
-	while (iterator != &head) {
+	block_meta_t *iterator = heap->head.next;
+
+	while (iterator != &heap->head) {
 		if (((char *)iterator + META_BLOCK_SIZE) == ptr)
 			return iterator;
 
@@ -241,21 +552,94 @@ block_meta_t *search_block_in_list(void *ptr)
 }
 
 /**
+ * The list only holds heap blocks, in address order, so the block
+ * before the head is the top of the heap.
  * @return The last block allocated on the heap, if it exists,
  * or NULL, otherwise.
  */
-block_meta_t *get_last_on_heap(void)
+block_meta_t *get_last_on_heap(heap_t *heap)
 {
-	block_meta_t *iterator = head.prev;
+	if (heap->head.prev == &heap->head)
+		return NULL;
 
-	while (iterator->status == STATUS_MAPPED && iterator != &head)
-		iterator = iterator->prev;
+	return heap->head.prev;
+}
 
-	if (iterator == &head)
-		return NULL;
+/**
+ * Removes block, the last one on the heap, from the list and returns
+ * its memory to the OS. The main heap is only shrunk if no one else
+ * moved the program break.
+ * @return 1 for success, 0 otherwise.
+ */
+int heap_shrink(heap_t *heap, block_meta_t *block)
+{
+	size_t decrement = META_BLOCK_SIZE + block->size;
+
+	if (heap->rover == block)
+		heap->rover = NULL;
+
+	if (heap->base) {
+		list_remove_block(block);
+		start_map_mark(heap, block, 0);
+		return vm_heap_shrink(heap, decrement);
+	}
+
+	char *heap_end = (char *)block + decrement;
+
+	if (sbrk(0) != heap_end)
+		return 0;
 
-	return iterator;
+	list_remove_block(block);
+
+	void *old_end = sbrk(-(intptr_t)decrement);
+
+	DIE(old_end == (void *) -1, "Critical error: sbrk() failed.\n");
+
+	STATS_ADD(nsbrk, 1);
+	STATS_SUB(heap_size, decrement);
+	return 1;
 }
+
+/**
+ * If trimming is enabled and the last block on the heap is free,
+ * coalesces it with the free blocks before it and returns it to the OS
+ * once it reaches the trim threshold.
+ */
+void trim_heap_attempt(heap_t *heap)
+{
+	if (conf.trim_threshold == 0)
+		return;
+
+	block_meta_t *last_on_heap = get_last_on_heap(heap);
+
+	if (!last_on_heap || last_on_heap->status != STATUS_FREE)
+		return;
+
+	free_index_remove(heap, last_on_heap);
+
+	block_meta_t *iterator = last_on_heap->prev;
+
+	while (iterator != &heap->head && iterator->status == STATUS_FREE) {
+		block_meta_t *prev = iterator->prev;
+
+		free_index_remove(heap, iterator);
+
+		coalesce_blocks(heap, iterator, last_on_heap);
+		last_on_heap = iterator;
+
+		iterator = prev;
+	}
+
+	size_t trim_size = META_BLOCK_SIZE + last_on_heap->size;
+
+	if (trim_size < conf.trim_threshold || !heap_shrink(heap, last_on_heap)) {
+		free_index_insert(heap, last_on_heap);
+		return;
+	}
+
+	STATS_ADD(trimmed_size, trim_size);
+}
+
 /**
  * Searches the list for the memory zone allocated on the heap
  * that best fits the requested @size.
@@ -264,48 +648,214 @@ block_meta_t *get_last_on_heap(void)
  * To be called when memory allocated with sbrk() is needed.
  * @return allocated memory in case of success, NULL otherwise.
  */
-block_meta_t *get_free_heap_block(size_t size)
+block_meta_t *get_free_heap_block(heap_t *heap, size_t size)
 {
-	if (!prealloc_heap_attempt()) {
+	if (!prealloc_heap_attempt(heap)) {
 		// sbrk() failed during preallocation
 		return NULL;
 	}
 
-	coalesce_attempt();
+	size = block_payload_size(size);
 
-	block_meta_t *best_block = find_best_block(ALIGN(size));
+	if (conf.fastbins) {
+		block_meta_t *fast_block = fastbin_pop(heap, size);
+
+		if (fast_block)
+			return fast_block;
+	}
+
+	// As in glibc, large requests first release the fastbins, so that
+	// their blocks can be merged into room for them.
+	if (size >= FASTBIN_CONSOLIDATE_SIZE && heap->fastbin_blocks)
+		fastbin_consolidate(heap);
+
+	coalesce_attempt(heap);
+
+	block_meta_t *best_block = find_free_block(heap, size);
+
+	// Release the fastbins before growing the heap.
+	if (!best_block && heap->fastbin_blocks) {
+		fastbin_consolidate(heap);
+		coalesce_attempt(heap);
+		best_block = find_free_block(heap, size);
+	}
 
 	if (best_block) {
-		split_block_attempt(best_block, ALIGN(size));
+		free_index_remove(heap, best_block);
+
+		// Taken before the split, so the remainder is not merged back.
+		best_block->status = STATUS_ALLOC;
+		split_block_attempt(heap, best_block, size);
+		best_block->purge = PURGE_DIRTY;
 		return best_block;
 	}
 
 	// There is no block able to sustain the requested size.
 	// Try to expand the last block, if it is free.
-	block_meta_t *last_on_heap = get_last_on_heap();
+	block_meta_t *last_on_heap = get_last_on_heap(heap);
 
-	if (last_on_heap != NULL && last_on_heap->status == STATUS_FREE) {
-		block_meta_t *expanded_block = expand_last_block(ALIGN(size));
+	if (last_on_heap != NULL && last_on_heap->status == STATUS_FREE &&
+		!heap_break_moved(heap)) {
+		free_index_remove(heap, last_on_heap);
 
-		if (!expanded_block)
-			return NULL;
+		block_meta_t *expanded_block = expand_last_block(heap, size);
+
+		if (expanded_block) {
+			expanded_block->purge = PURGE_DIRTY;
+			return expanded_block;
+		}
 
-		return expanded_block;
+		free_index_insert(heap, last_on_heap);
 	}
 
-	// The last block is not free, so a new block is created.
-	void *request_block = sbrk(META_BLOCK_SIZE + ALIGN(size));
+	// The last block can not be expanded, so a new block is created.
+	return heap_add_block(heap, size);
+}
 
-	if (request_block == (void *) -1)
+/**
+ * Takes a heap block of size bytes whose payload starts a page. The
+ * space before the payload is split off as a free block of its own.
+ * The heap lock must be held.
+ * @return the block, or NULL on failure.
+ */
+block_meta_t *get_page_aligned_heap_block(heap_t *heap, size_t size)
+{
+	size_t page_size = getpagesize();
+	size_t lead_min = META_BLOCK_SIZE + block_payload_size(1);
+	block_meta_t *block = get_free_heap_block(heap, size + page_size + lead_min);
+
+	if (!block)
 		return NULL;
 
-	block_meta_t *new_block = (block_meta_t *)request_block;
+	block->status = STATUS_ALLOC;
 
-	new_block->size = ALIGN(size);
+	uintptr_t payload = (uintptr_t)block + META_BLOCK_SIZE;
+	uintptr_t aligned = (payload + page_size - 1) & ~(page_size - 1);
 
-	list_add_last(new_block);
+	// The space left before the payload must hold a free block.
+	if (aligned != payload && aligned - payload < lead_min)
+		aligned += page_size;
 
-	return new_block;
+	if (aligned != payload) {
+		block_meta_t *aligned_block = (block_meta_t *)(aligned - META_BLOCK_SIZE);
+
+		aligned_block->size = block->size - (aligned - payload);
+		aligned_block->status = STATUS_ALLOC;
+		aligned_block->arena = block->arena;
+		aligned_block->purge = block->purge;
+
+		aligned_block->next = block->next;
+		aligned_block->prev = block;
+		block->next->prev = aligned_block;
+		block->next = aligned_block;
+		block->size = aligned - payload - META_BLOCK_SIZE;
+
+		start_map_mark(heap, aligned_block, 1);
+		release_heap_block(heap, block);
+		block = aligned_block;
+	}
+
+	split_block_attempt(heap, block, size);
+	return block;
+}
+
+/**
+ * Allocates size bytes from heap, either on the heap itself or in
+ * a new mapping. A heap whose reserved range is exhausted falls
+ * back to mappings, except for the arenas, which fail so that the
+ * caller can use the main heap. The heap lock must be held.
+ */
+void *heap_malloc(heap_t *heap, size_t size)
+{
+	// The alignment is done before calling any function, so they
+	// ought not bother with alignment.
+	size_t aligned_size = ALIGN(size);
+
+	if (aligned_size + META_BLOCK_SIZE < conf.mmap_threshold) {
+		block_meta_t *heap_block = get_free_heap_block(heap, aligned_size);
+
+		if (heap_block) {
+			heap_block->status = STATUS_ALLOC;
+			return (void *)((char *)heap_block + META_BLOCK_SIZE);
+		}
+
+		if (!heap_maps_overflow(heap))
+			return NULL;
+	}
+
+	block_meta_t *block = map_block_in_mem(heap, aligned_size);
+
+	if (!block)
+		return NULL;
+
+	return (void *)((char *)block + META_BLOCK_SIZE);
+}
+
+/**
+ * Frees the block whose payload is ptr. Pointers that do not belong
+ * to heap are ignored. The heap lock must be held.
+ */
+void heap_free(heap_t *heap, void *ptr)
+{
+	block_meta_t *block = search_block_in_list(heap, ptr);
+
+	if (!block)
+		return;
+
+	// Blocks already freed, including those kept in the fastbins.
+	if (block->status == STATUS_FREE || block->status == STATUS_FASTBIN)
+		return;
+
+	if (conf.grow_streak)
+		growth_forget(heap, block);
+
+	if (block->status == STATUS_MAPPED) {
+		delete_mapped_block(heap, block);
+		return;
+	}
+
+	if (block->status == STATUS_ALLOC) {
+		if (conf.fastbins && fastbin_push(heap, block))
+			return;
+
+		release_heap_block(heap, block);
+		trim_heap_attempt(heap);
+
+		if (conf.background_thread)
+			decay_thread_start();
+		return;
+	}
+}
+
+/**
+ * Allocates aligned_size zeroed bytes from heap. Sizes below a page
+ * are placed on the heap, bigger ones are mapped.
+ * The heap lock must be held.
+ */
+void *heap_calloc(heap_t *heap, size_t aligned_size)
+{
+	if ((long)(aligned_size + META_BLOCK_SIZE) < (long)getpagesize()) {
+		block_meta_t *heap_block = get_free_heap_block(heap, aligned_size);
+
+		if (heap_block) {
+			heap_block->status = STATUS_ALLOC;
+			bulk_zero((char *)heap_block + META_BLOCK_SIZE, aligned_size);
+			return (void *)((char *)heap_block + META_BLOCK_SIZE);
+		}
+
+		if (!heap_maps_overflow(heap))
+			return NULL;
+	}
+
+	block_meta_t *block = map_block_in_mem(heap, aligned_size);
+
+	if (!block)
+		return NULL;
+
+	void *result = (void *)((char *)block + META_BLOCK_SIZE);
+
+	bulk_zero(result, aligned_size);
+	return result;
 }
 
 void *os_malloc(size_t size)
@@ -317,27 +867,48 @@ void *os_malloc(size_t size)
 	if (!head_init_done)
 		head_init();
 
-	// The alignment is done before calling any function, so they
-	// ought not bother with alignment.
-	size_t aligned_size = ALIGN(size);
+	STATS_ADD(nmalloc, 1);
 
-	if (aligned_size + META_BLOCK_SIZE < MMAP_THRESHOLD) {
-		block_meta_t *heap_block = get_free_heap_block(aligned_size);
+	// Buddy blocks and spans of a page or more already are page aligned.
+	if (conf.buddy) {
+		void *block = buddy_alloc(ALIGN(size));
 
-		if (!heap_block)
-			return NULL;
+		if (block)
+			return block;
+	}
 
-		heap_block->status = STATUS_ALLOC;
-		return (void *)((char *)heap_block + META_BLOCK_SIZE);
+	if (conf.page_heap) {
+		void *span = page_heap_alloc(ALIGN(size), NULL);
 
-	} else {
-		block_meta_t *block = map_block_in_mem(aligned_size);
+		if (span)
+			return span;
+	}
 
-		if (!block)
-			return NULL;
+	if (conf.page_align && ALIGN(size) >= (size_t)getpagesize())
+		return page_aligned_alloc(ALIGN(size), 0);
 
-		return (void *)((char *)block + META_BLOCK_SIZE);
+	if (conf.tcache_size) {
+		void *cached = tcache_get(ALIGN(size));
+
+		if (cached)
+			return cached;
+	}
+
+	heap_t *heap = arena_get();
+
+	heap_lock(heap);
+	void *result = heap_malloc(heap, size);
+
+	heap_unlock(heap);
+
+	// An arena whose range is used up hands its requests to the main heap.
+	if (!result && heap != main_heap) {
+		heap_lock(main_heap);
+		result = heap_malloc(main_heap, size);
+		heap_unlock(main_heap);
 	}
+
+	return result;
 }
 
 void os_free(void *ptr)
@@ -345,23 +916,32 @@ void os_free(void *ptr)
 	if (!ptr)
 		return;
 
-	block_meta_t *block = search_block_in_list(ptr);
+	if (!head_init_done)
+		head_init();
 
-	if (!block)
-		return;
+	STATS_ADD(nfree, 1);
 
-	if (block->status == STATUS_FREE)
+	// Cheapest owner checks first: the buddy zone is a range check and
+	// the page heap a lookup in its map, both without a lock.
+	if (buddy_free(ptr) || page_heap_free(ptr) || page_block_free(ptr))
 		return;
 
-	if (block->status == STATUS_MAPPED) {
-		delete_mapped_block(block);
+	if (conf.tcache_size && tcache_put(ptr))
 		return;
-	}
 
-	if (block->status == STATUS_ALLOC) {
-		block->status = STATUS_FREE;
+	heap_t *heap = heap_of_block(ptr);
+
+	// Blocks of other arenas are handed back to their owner
+	// without waiting for its lock. A thread that never allocated
+	// has no arena, and every block it frees belongs to another one.
+	if (heap != arena_current() && conf.remote_free) {
+		remote_free_push(heap, ptr);
 		return;
 	}
+
+	heap_lock(heap);
+	heap_free(heap, ptr);
+	heap_unlock(heap);
 }
 
 void *os_calloc(size_t nmemb, size_t size)
@@ -372,46 +952,82 @@ void *os_calloc(size_t nmemb, size_t size)
 	if (!head_init_done)
 		head_init();
 
+	STATS_ADD(ncalloc, 1);
+
 	size_t aligned_size = ALIGN(size * nmemb);
 
 	// Check for overflow.
 	if (aligned_size < size || aligned_size < nmemb)
 		return NULL;
 
-	if ((long)(aligned_size + META_BLOCK_SIZE) < (long)getpagesize()) {
-		block_meta_t *heap_block = get_free_heap_block(aligned_size);
+	// Buddy blocks are reused without being cleared.
+	if (conf.buddy) {
+		void *block = buddy_alloc(aligned_size);
 
-		if (!heap_block)
-			return NULL;
+		if (block) {
+			bulk_zero(block, aligned_size);
+			return block;
+		}
+	}
 
-		heap_block->status = STATUS_ALLOC;
-		memset((char *)heap_block + META_BLOCK_SIZE, 0, aligned_size);
-		return (void *)((char *)heap_block + META_BLOCK_SIZE);
+	// Spans are only cleared if their pages were used before.
+	if (conf.page_heap) {
+		int clean;
+		void *span = page_heap_alloc(aligned_size, &clean);
+
+		if (span) {
+			if (!clean)
+				bulk_zero(span, aligned_size);
+			return span;
+		}
 	}
 
-	block_meta_t *block = map_block_in_mem(aligned_size);
+	if (conf.page_align && aligned_size >= (size_t)getpagesize())
+		return page_aligned_alloc(aligned_size, 1);
 
-	if (!block)
-		return NULL;
+	if (conf.tcache_size) {
+		void *cached = tcache_get(aligned_size);
 
-	void *result = (void *)((char *)block + META_BLOCK_SIZE);
+		if (cached) {
+			memset(cached, 0, aligned_size);
+			return cached;
+		}
+	}
+
+	heap_t *heap = arena_get();
+
+	heap_lock(heap);
+	void *result = heap_calloc(heap, aligned_size);
+
+	heap_unlock(heap);
+
+	if (!result && heap != main_heap) {
+		heap_lock(main_heap);
+		result = heap_calloc(main_heap, aligned_size);
+		heap_unlock(main_heap);
+	}
 
-	memset(result, 0, aligned_size);
 	return result;
 }
 
 /**
- * Remove a mapped block from the list and unmap its memory zone.
+ * Remove a mapped block from the registry and unmap its memory zone.
  */
-void delete_mapped_block(block_meta_t *block)
+void delete_mapped_block(heap_t *heap, block_meta_t *block)
 {
 	if (block->status != STATUS_MAPPED)
 		return;
 
-	list_remove_block(block);
-	int munmap_ret_val = munmap(block, block->size + META_BLOCK_SIZE);
+	size_t map_size = block->size + META_BLOCK_SIZE;
+
+	mapped_remove(heap, block);
+
+	if (map_reserved(block))
+		map_reserve_release(block);
+	else
+		release_mapping(block, map_size);
 
-	DIE(munmap_ret_val == -1, "Critical error: munmap() failed.\n");
+	STATS_SUB(mapped_size, map_size);
 }
 
 /**
@@ -422,64 +1038,215 @@ void copy_block(block_meta_t *dest, block_meta_t *src, size_t size)
 	void *dest_payload = (void *)((char *)dest + META_BLOCK_SIZE);
 	void *src_payload = (void *)((char *)src + META_BLOCK_SIZE);
 
-	memmove(dest_payload, src_payload, size);
+	bulk_copy(dest_payload, src_payload, size);
+}
+
+/**
+ * Takes a block for the new copy of a reallocated block from the heap.
+ * A heap whose reserved range is exhausted maps it instead, unless it
+ * is an arena.
+ * @return the allocated block, or NULL.
+ */
+block_meta_t *realloc_heap_block(heap_t *heap, size_t size)
+{
+	block_meta_t *block = get_free_heap_block(heap, size);
+
+	if (block) {
+		block->status = STATUS_ALLOC;
+		return block;
+	}
+
+	if (!heap_maps_overflow(heap))
+		return NULL;
+
+	return map_block_in_mem(heap, size);
+}
+
+/**
+ * Shrinks a mapped block in place, unmapping the pages past its new end.
+ */
+void shrink_mapped_block(block_meta_t *block, size_t size)
+{
+	if (map_reserved(block)) {
+		map_reserve_shrink(block, size);
+		return;
+	}
+
+	size_t page_size = getpagesize();
+	uintptr_t old_end = (uintptr_t)block + META_BLOCK_SIZE + block->size;
+	uintptr_t new_end = (uintptr_t)block + META_BLOCK_SIZE + size;
+
+	old_end = (old_end + page_size - 1) & ~(page_size - 1);
+	new_end = (new_end + page_size - 1) & ~(page_size - 1);
+
+	if (new_end < old_end)
+		release_mapping((void *)new_end, old_end - new_end);
+
+	STATS_SUB(mapped_size, block->size - size);
+	block->size = size;
+}
+
+/**
+ * Grows a mapped block in place to preferred_size bytes, or else to
+ * min_size bytes, using the rest of its last page or the pages after it.
+ * @return 1 for success, 0 otherwise.
+ */
+int expand_mapped_block(block_meta_t *block, size_t min_size, size_t preferred_size)
+{
+	size_t page_size = getpagesize();
+	uintptr_t map_end = (uintptr_t)block + META_BLOCK_SIZE + block->size;
+	size_t targets[] = { preferred_size, min_size };
+
+	if (map_reserved(block))
+		return map_reserve_grow(block, preferred_size) || map_reserve_grow(block, min_size);
+
+	map_end = (map_end + page_size - 1) & ~(page_size - 1);
+
+	for (int i = 0; i < 2; i++) {
+		uintptr_t new_end = (uintptr_t)block + META_BLOCK_SIZE + targets[i];
+
+		new_end = (new_end + page_size - 1) & ~(page_size - 1);
+
+		if (new_end <= map_end || mapping_grow((void *)map_end, new_end - map_end)) {
+			STATS_ADD(mapped_size, targets[i] - block->size);
+			block->size = targets[i];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Grows the block whose payload is ptr without moving it: with the free
+ * blocks after it, by extending the heap if it is the last block, or by
+ * extending its mapping. The heap lock must be held.
+ * @return the new payload size, or 0 if the block can not hold min_size
+ * bytes in place, in which case it is left unchanged.
+ */
+size_t heap_expand(heap_t *heap, void *ptr, size_t min_size, size_t preferred_size)
+{
+	block_meta_t *block = search_block_in_list(heap, ptr);
+
+	if (!block || block->status == STATUS_FREE || block->status == STATUS_FASTBIN)
+		return 0;
+
+	min_size = ALIGN(min_size);
+	preferred_size = ALIGN(preferred_size) < min_size ? min_size : ALIGN(preferred_size);
+
+	if (block->size >= min_size)
+		return block->size;
+
+	if (block->status == STATUS_MAPPED)
+		return expand_mapped_block(block, min_size, preferred_size) ? block->size : 0;
+
+	size_t original_block_size = block->size;
+
+	block_coalesce_to_size(heap, block, preferred_size);
+
+	if (block->size < min_size && block == get_last_on_heap(heap)) {
+		if (!expand_last_block(heap, preferred_size))
+			expand_last_block(heap, min_size);
+	}
+
+	if (block->size < min_size) {
+		// Give back the free blocks that were merged.
+		split_block_attempt(heap, block, original_block_size);
+		return 0;
+	}
+
+	if (block->size > preferred_size)
+		split_block_attempt(heap, block, preferred_size);
+
+	return block->size;
+}
+
+size_t os_expand(void *ptr, size_t min_size, size_t preferred_size)
+{
+	if (!ptr || min_size == 0)
+		return 0;
+
+	if (preferred_size < min_size)
+		preferred_size = min_size;
+
+	size_t result;
+
+	if (buddy_expand(ptr, min_size, preferred_size, &result) ||
+		page_heap_expand(ptr, min_size, preferred_size, &result) ||
+		page_block_expand(ptr, min_size, preferred_size, &result))
+		return result;
+
+	heap_t *heap = heap_of_block(ptr);
+
+	heap_lock(heap);
+	result = heap_expand(heap, ptr, min_size, preferred_size);
+	heap_unlock(heap);
+
+	return result;
 }
 
 /**
  * Reallocates memory to a smaller size.
  */
-void *shrink_realloc(block_meta_t *block, size_t size)
+void *shrink_realloc(heap_t *heap, block_meta_t *block, size_t size)
 {
 	if (block->status == STATUS_MAPPED) {
-		if (size >= MMAP_THRESHOLD) {
+		// With hysteresis, mapped blocks stay mapped unless they shrink
+		// well below the threshold, and are shrunk without a copy. So
+		// are blocks mapped with headroom that stay mapped.
+		if ((conf.mmap_hysteresis &&
+			size + META_BLOCK_SIZE + conf.mmap_hysteresis >= conf.mmap_threshold) ||
+			(map_reserved(block) && size >= conf.mmap_threshold)) {
+			shrink_mapped_block(block, size);
+			return (void *)((char *)block + META_BLOCK_SIZE);
+		}
+
+		if (size >= conf.mmap_threshold) {
 			// Shrink mapped block to another mapped block.
-			block_meta_t *new_map_block = map_block_in_mem(size);
+			block_meta_t *new_map_block = map_block_in_mem(heap, size);
 
 			if (!new_map_block)
 				return NULL;
 
 			copy_block(new_map_block, block, new_map_block->size);
 
-			delete_mapped_block(block);
+			delete_mapped_block(heap, block);
 			return (void *)((char *)new_map_block + META_BLOCK_SIZE);
 		}
 
 		// Shrink mapped block to a block on heap.
-		block_meta_t *heap_block = get_free_heap_block(size);
+		block_meta_t *heap_block = realloc_heap_block(heap, size);
 
 		if (!heap_block)
 			return NULL;
 
-		heap_block->status = STATUS_ALLOC;
-
 		copy_block(heap_block, block, heap_block->size);
-		delete_mapped_block(block);
+		delete_mapped_block(heap, block);
 
 		return (void *)((char *)heap_block + META_BLOCK_SIZE);
 	}
 
 	// Shrink alloc'd block.
-	split_block_attempt(block, size);
+	split_block_attempt(heap, block, size);
 	return (void *)((char *)block + META_BLOCK_SIZE);
 }
 
 /**
  * Coalesces heap block to adjacent free blocks until its size exceeds size.
  */
-void block_coalesce_to_size(block_meta_t *block, size_t size)
+void block_coalesce_to_size(heap_t *heap, block_meta_t *block, size_t size)
 {
 	block_meta_t *iterator = block->next;
 
-	while (iterator != &head) {
+	while (iterator != &heap->head) {
 		if (iterator->status == STATUS_FREE) {
-			coalesce_blocks(block, iterator);
+			free_index_remove(heap, iterator);
+
+			coalesce_blocks(heap, block, iterator);
 
 			if (block->size >= size)
 				break;
 
-			iterator = iterator->next;
-			continue;
-		} else if (iterator->status == STATUS_MAPPED) {
 			iterator = iterator->next;
 			continue;
 		} else {
@@ -491,82 +1258,92 @@ void block_coalesce_to_size(block_meta_t *block, size_t size)
 /**
  * Reallocates memory to a bigger size.
  */
-void *extend_realloc(block_meta_t *block, size_t size)
+void *extend_realloc(heap_t *heap, block_meta_t *block, size_t size)
 {
 	if (block->status == STATUS_MAPPED) {
-		block_meta_t *new_map_block = map_block_in_mem(size);
+		// Blocks mapped with headroom grow into it.
+		if (map_reserve_grow(block, size))
+			return (void *)((char *)block + META_BLOCK_SIZE);
+
+		block_meta_t *new_map_block = map_block_in_mem(heap, size);
 
 		if (!new_map_block)
 			return NULL;
 
 		copy_block(new_map_block, block, block->size);
-		delete_mapped_block(block);
+		delete_mapped_block(heap, block);
 
 		return (void *)((char *)new_map_block + META_BLOCK_SIZE);
 	}
 
-	// Original block was alloc'd.
-	if (size >= MMAP_THRESHOLD) {
-		block_meta_t *new_map_block = map_block_in_mem(size);
+	// Original block was alloc'd. With hysteresis, it is only moved
+	// to a mapping once it grows well past the threshold.
+	if (size >= conf.mmap_threshold + conf.mmap_hysteresis) {
+		block_meta_t *new_map_block = map_block_in_mem(heap, size);
 
 		if (!new_map_block)
 			return NULL;
 
 		copy_block(new_map_block, block, block->size);
-		block->status = STATUS_FREE;
+		release_heap_block(heap, block);
 
 		return (void *)((char *)new_map_block + META_BLOCK_SIZE);
 	}
 
 	// Check if it is the last block from heap. If so, just extend it.
-	block_meta_t *last_on_heap = get_last_on_heap();
+	block_meta_t *last_on_heap = get_last_on_heap(heap);
 
 	if (block == last_on_heap) {
-		block = expand_last_block(size);
+		if (expand_last_block(heap, size))
+			return (void *)((char *)block + META_BLOCK_SIZE);
 
-		if (!block)
-			return NULL;
+		if (heap_maps_overflow(heap)) {
+			block_meta_t *new_map_block = map_block_in_mem(heap, size);
 
-		return (void *)((char *)block + META_BLOCK_SIZE);
+			if (!new_map_block)
+				return NULL;
+
+			copy_block(new_map_block, block, block->size);
+			release_heap_block(heap, block);
+
+			return (void *)((char *)new_map_block + META_BLOCK_SIZE);
+		}
+
+		// Otherwise the block is moved within the heap, if it has room.
 	}
 
 	// Try to extend current block, coalescing it to adjacent free blocks.
 	size_t original_block_size = block->size;
 
-	block_coalesce_to_size(block, size);
+	block_coalesce_to_size(heap, block, size);
 
 	if (block->size >= size) {
-		split_block_attempt(block, size);
+		split_block_attempt(heap, block, size);
 		return (void *)((char *)block + META_BLOCK_SIZE);
 	}
 
 	// The block is still not big enough, so a reallocation is necessary.
-	block_meta_t *heap_block = get_free_heap_block(size);
+	block_meta_t *heap_block = realloc_heap_block(heap, size);
 
 	if (!heap_block)
 		return NULL;
 
-	heap_block->status = STATUS_ALLOC;
-
 	copy_block(heap_block, block, original_block_size);
-	block->status = STATUS_FREE;
+	release_heap_block(heap, block);
 
 	return (void *)((char *)heap_block + META_BLOCK_SIZE);
 }
 
-void *os_realloc(void *ptr, size_t size)
+/**
+ * Resizes the block whose payload is ptr, within heap.
+ * The heap lock must be held.
+ */
+void *heap_realloc(heap_t *heap, void *ptr, size_t size)
 {
-	if (ptr == NULL)
-		return os_malloc(size);
-
-	if (size == 0) {
-		os_free(ptr);
-		return NULL;
-	}
+	block_meta_t *req_block = search_block_in_list(heap, ptr);
 
-	block_meta_t *req_block = search_block_in_list(ptr);
-
-	if (!req_block || req_block->status == STATUS_FREE)
+	if (!req_block || req_block->status == STATUS_FREE ||
+		req_block->status == STATUS_FASTBIN)
 		return NULL;
 
 	size_t aligned_size = ALIGN(size);
@@ -576,11 +1353,55 @@ void *os_realloc(void *ptr, size_t size)
 		return (void *)((char *)req_block + META_BLOCK_SIZE);
 	}
 
+	void *result;
+
+	if (conf.grow_streak && growth_realloc(heap, req_block, aligned_size, &result))
+		return result;
+
 	if (aligned_size > req_block->size)
-		return extend_realloc(req_block, aligned_size);
+		return extend_realloc(heap, req_block, aligned_size);
 
 	if (aligned_size < req_block->size)
-		return shrink_realloc(req_block, aligned_size);
+		return shrink_realloc(heap, req_block, aligned_size);
 
 	return NULL;
 }
+
+void *os_realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return os_malloc(size);
+
+	if (size == 0) {
+		os_free(ptr);
+		return NULL;
+	}
+
+	if (!head_init_done)
+		head_init();
+
+	STATS_ADD(nrealloc, 1);
+
+	void *result;
+
+	if (buddy_realloc(ptr, size, &result) || page_heap_realloc(ptr, size, &result) ||
+		page_block_realloc(ptr, size, &result))
+		return result;
+
+	if (conf.page_align && ALIGN(size) >= (size_t)getpagesize())
+		return page_block_move(ptr, size);
+
+	// The block is resized in the heap that owns it, so that
+	// only one heap lock is ever held at a time.
+	heap_t *heap = heap_of_block(ptr);
+
+	heap_lock(heap);
+	result = heap_realloc(heap, ptr, size);
+
+	heap_unlock(heap);
+
+	if (!result && heap != main_heap)
+		result = arena_overflow_realloc(heap, ptr, size);
+
+	return result;
+}
@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * With page_align enabled, os_malloc() and os_calloc() give requests of
+ * at least a page a page aligned payload. Below the mmap threshold, it
+ * is a heap block placed so that its payload starts a page. From the
+ * threshold, the request is mapped on its own, with the payload at the
+ * start of the mapping. The header of such a page block is kept apart,
+ * found through a hash table keyed by the payload address, so the
+ * payload pages hold nothing but user data.
+ */
+struct page_block {
+	void *payload;
+	size_t size;
+	size_t map_size;
+	struct page_block *next;
+};
+
+struct page_block *page_blocks[PAGE_BLOCK_BUCKETS];
+unsigned long page_blocks_nr;
+pthread_mutex_t page_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Unused headers, and the rest of the batch they are taken from.
+struct page_block *page_blocks_spare;
+struct page_block *page_blocks_batch;
+size_t page_blocks_batch_left;
+
+unsigned int page_block_hash(void *payload)
+{
+	return ptr_hash(payload, 12, PAGE_BLOCK_HASH_BITS);
+}
+
+/**
+ * Headers are taken from batches mapped for them, so they are neither
+ * counted nor placed as user allocations. The lock must be held.
+ * @return an unused header, or NULL on failure.
+ */
+struct page_block *page_block_new(void)
+{
+	struct page_block *block = page_blocks_spare;
+
+	if (block) {
+		page_blocks_spare = block->next;
+		return block;
+	}
+
+	if (!page_blocks_batch_left) {
+		void *batch = mmap(NULL, PAGE_BLOCK_BATCH_SIZE, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (batch == MAP_FAILED)
+			return NULL;
+
+		STATS_ADD(nmmap, 1);
+
+		page_blocks_batch = batch;
+		page_blocks_batch_left = PAGE_BLOCK_BATCH_SIZE / sizeof(struct page_block);
+	}
+
+	page_blocks_batch_left--;
+
+	return page_blocks_batch++;
+}
+
+/**
+ * Puts block back among the unused headers. The lock must be held.
+ */
+void page_block_delete(struct page_block *block)
+{
+	block->next = page_blocks_spare;
+	page_blocks_spare = block;
+}
+
+/**
+ * Maps a page aligned block of size bytes.
+ * @return the payload, or NULL on failure.
+ */
+void *page_block_alloc(size_t size)
+{
+	size_t page_size = getpagesize();
+	size_t map_size = (size + page_size - 1) & ~(page_size - 1);
+	void *payload;
+
+	if (conf.thp && map_size >= HUGE_PAGE_SIZE) {
+		payload = thp_map(map_size);
+	} else {
+		payload = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (payload != MAP_FAILED)
+			STATS_ADD(nmmap, 1);
+	}
+
+	if (payload == MAP_FAILED)
+		return NULL;
+
+	struct page_block **bucket = &page_blocks[page_block_hash(payload)];
+
+	pthread_mutex_lock(&page_blocks_lock);
+
+	struct page_block *block = page_block_new();
+
+	if (!block) {
+		pthread_mutex_unlock(&page_blocks_lock);
+		release_mapping(payload, map_size);
+		return NULL;
+	}
+
+	block->payload = payload;
+	block->size = size;
+	block->map_size = map_size;
+	block->next = *bucket;
+	__atomic_store_n(bucket, block, __ATOMIC_RELEASE);
+	page_blocks_nr++;
+	pthread_mutex_unlock(&page_blocks_lock);
+
+	STATS_ADD(mapped_size, map_size);
+
+	return payload;
+}
+
+/**
+ * Allocates size bytes with a page aligned payload: on the heap below
+ * the mmap threshold, as a page block from it. Payloads are zeroed if
+ * zero is set, fresh mappings already are.
+ * @return the payload, or NULL on failure.
+ */
+void *page_aligned_alloc(size_t size, int zero)
+{
+	if (size + META_BLOCK_SIZE < conf.mmap_threshold) {
+		heap_t *heap = arena_get();
+
+		heap_lock(heap);
+		block_meta_t *block = get_page_aligned_heap_block(heap, size);
+
+		heap_unlock(heap);
+
+		// An arena whose range is used up hands them to the main heap.
+		if (!block && heap != main_heap) {
+			heap_lock(main_heap);
+			block = get_page_aligned_heap_block(main_heap, size);
+			heap_unlock(main_heap);
+		}
+
+		if (block) {
+			void *payload = (char *)block + META_BLOCK_SIZE;
+
+			if (zero)
+				bulk_zero(payload, size);
+			return payload;
+		}
+	}
+
+	return page_block_alloc(size);
+}
+
+/**
+ * Finds the header of the page aligned block ptr and, if remove is set,
+ * takes it out of the table. The lock is only taken if the bucket of
+ * ptr holds any block.
+ * @return the header, or NULL if ptr is not a page aligned block.
+ */
+struct page_block *page_block_find(void *ptr, int remove)
+{
+	if (((uintptr_t)ptr & (getpagesize() - 1)) != 0 ||
+		!__atomic_load_n(&page_blocks_nr, __ATOMIC_RELAXED))
+		return NULL;
+
+	struct page_block **bucket = &page_blocks[page_block_hash(ptr)];
+
+	if (!__atomic_load_n(bucket, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	pthread_mutex_lock(&page_blocks_lock);
+
+	struct page_block **iterator = bucket;
+
+	while (*iterator && (*iterator)->payload != ptr)
+		iterator = &(*iterator)->next;
+
+	struct page_block *block = *iterator;
+
+	if (block && remove) {
+		__atomic_store_n(iterator, block->next, __ATOMIC_RELEASE);
+		page_blocks_nr--;
+	}
+
+	pthread_mutex_unlock(&page_blocks_lock);
+
+	return block;
+}
+
+/**
+ * Unmaps ptr if it is a page aligned block.
+ * @return 1 if it was one, 0 otherwise.
+ */
+int page_block_free(void *ptr)
+{
+	struct page_block *block = page_block_find(ptr, 1);
+
+	if (!block)
+		return 0;
+
+	release_mapping(block->payload, block->map_size);
+	STATS_SUB(mapped_size, block->map_size);
+
+	pthread_mutex_lock(&page_blocks_lock);
+	page_block_delete(block);
+	pthread_mutex_unlock(&page_blocks_lock);
+
+	return 1;
+}
+
+/**
+ * Unmaps the pages of block past size bytes.
+ */
+void page_block_shrink(struct page_block *block, size_t size)
+{
+	size_t page_size = getpagesize();
+	size_t map_size = (size + page_size - 1) & ~(page_size - 1);
+
+	if (map_size < block->map_size) {
+		release_mapping((char *)block->payload + map_size, block->map_size - map_size);
+		STATS_SUB(mapped_size, block->map_size - map_size);
+		block->map_size = map_size;
+	}
+
+	block->size = size;
+}
+
+/**
+ * Resizes ptr if it is a page aligned block. The block stays in place
+ * while size fits in its mapping, giving back the pages it no longer
+ * needs, unless it shrinks below the mmap threshold, as shrink_realloc()
+ * does for mapped blocks. Otherwise it is moved to a new block.
+ * @return 1 if ptr was a page aligned block, with the new payload or
+ * NULL stored in *result, 0 otherwise.
+ */
+int page_block_realloc(void *ptr, size_t size, void **result)
+{
+	struct page_block *block = page_block_find(ptr, 0);
+
+	if (!block)
+		return 0;
+
+	if (size <= block->map_size &&
+		(size >= block->size ||
+		 size + META_BLOCK_SIZE + conf.mmap_hysteresis >= conf.mmap_threshold)) {
+		page_block_shrink(block, size);
+		*result = ptr;
+		return 1;
+	}
+
+	*result = os_malloc(size);
+	if (*result) {
+		bulk_copy(*result, ptr, block->size < size ? block->size : size);
+		page_block_free(ptr);
+	}
+
+	return 1;
+}
+
+/**
+ * Grows ptr in place if it is a page aligned block, within its mapping
+ * or by extending the mapping, to preferred_size or else min_size bytes.
+ * @return 1 if ptr was a page aligned block, with the new size or 0 on
+ * failure stored in *result, 0 otherwise.
+ */
+int page_block_expand(void *ptr, size_t min_size, size_t preferred_size, size_t *result)
+{
+	struct page_block *block = page_block_find(ptr, 0);
+
+	if (!block)
+		return 0;
+
+	size_t page_size = getpagesize();
+	size_t targets[] = { preferred_size, min_size };
+
+	*result = 0;
+
+	if (block->size >= min_size) {
+		*result = block->size;
+		return 1;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		size_t map_size = (targets[i] + page_size - 1) & ~(page_size - 1);
+
+		if (map_size > block->map_size) {
+			if (!mapping_grow((char *)block->payload + block->map_size,
+							  map_size - block->map_size))
+				continue;
+
+			STATS_ADD(mapped_size, map_size - block->map_size);
+			block->map_size = map_size;
+		}
+
+		block->size = targets[i];
+		*result = targets[i];
+		break;
+	}
+
+	return 1;
+}
+
+/**
+ * Resizes the heap block ptr to size bytes with a page aligned payload.
+ * A heap block that already is page aligned is resized in place while
+ * it stays below the mmap threshold, otherwise it is moved.
+ * @return the new payload, or NULL on failure.
+ */
+void *page_block_move(void *ptr, size_t size)
+{
+	heap_t *heap = heap_of_block(ptr);
+	size_t aligned_size = ALIGN(size);
+
+	heap_lock(heap);
+	block_meta_t *block = search_block_in_list(heap, ptr);
+	size_t old_size = (block && (block->status == STATUS_ALLOC ||
+								 block->status == STATUS_MAPPED)) ? block->size : 0;
+
+	if (old_size && block->status == STATUS_ALLOC &&
+		((uintptr_t)ptr & (getpagesize() - 1)) == 0 &&
+		aligned_size + META_BLOCK_SIZE < conf.mmap_threshold) {
+		if (aligned_size <= old_size ||
+			heap_expand(heap, ptr, aligned_size, aligned_size)) {
+			split_block_attempt(heap, block, aligned_size);
+			heap_unlock(heap);
+			return ptr;
+		}
+	}
+
+	heap_unlock(heap);
+
+	if (!old_size)
+		return NULL;
+
+	void *result = page_aligned_alloc(aligned_size, 0);
+
+	if (!result)
+		return NULL;
+
+	bulk_copy(result, ptr, old_size < size ? old_size : size);
+	os_free(ptr);
+
+	return result;
+}
+
+void page_blocks_prefork(void)
+{
+	pthread_mutex_lock(&page_blocks_lock);
+}
+
+void page_blocks_postfork_parent(void)
+{
+	pthread_mutex_unlock(&page_blocks_lock);
+}
+
+void page_blocks_postfork_child(void)
+{
+	pthread_mutex_init(&page_blocks_lock, NULL);
+}
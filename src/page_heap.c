@@ -0,0 +1,815 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * With page_heap enabled, the requests that would be mapped on their own
+ * are served from spans, runs of whole pages carved out of chunks mapped
+ * in steps of PAGE_HEAP_CHUNK bytes. A freed span is merged with the
+ * free spans before and after it, so the pages are reused by requests of
+ * any size without another mmap(). Free spans are kept in one list per
+ * number of pages up to SPAN_LISTS, the bigger ones in a single list
+ * searched for the best fit. Once more free pages are dirty than a
+ * quarter of the pages in use, the biggest free spans are purged.
+ *
+ * Chunks start on a huge page boundary and the pages in use in each of
+ * their huge pages are counted. With hugepage_filler enabled, spans
+ * smaller than a huge page are carved out of the fullest huge pages and
+ * whole free huge pages are purged first, so that as many huge pages as
+ * possible are either fully used, and can be backed by a single TLB
+ * entry, or empty, and can be given back to the OS as a whole.
+ *
+ * The span of a page is found through a radix map indexed by the page
+ * number. Every page of a chunk is mapped once it is created, so a
+ * pointer belongs to the page heap if its page is in the map; the first
+ * and the last page of each span always point to it, which is what frees
+ * and merges look up. Spans have no header in their pages, the payload
+ * starts the span.
+ */
+#define SPAN_FREE		0
+#define SPAN_IN_USE		1
+
+#define SPAN_MAP_BITS		12
+#define SPAN_MAP_SIZE		(1UL << SPAN_MAP_BITS)
+#define SPAN_MAP_MASK		(SPAN_MAP_SIZE - 1)
+
+#define HUGE_PAGE_PAGES		(HUGE_PAGE_SIZE >> SPAN_PAGE_SHIFT)
+#define LEAF_HUGE_PAGES		(SPAN_MAP_SIZE / HUGE_PAGE_PAGES)
+
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+struct span {
+	uintptr_t page;
+	size_t npages;
+	size_t size;
+	int state;
+	// Pages still zero, as mapped or purged.
+	int clean;
+	struct span *next;
+	struct span *prev;
+};
+
+struct span_leaf {
+	struct span *spans[SPAN_MAP_SIZE];
+	// Pages in use in each huge page of the leaf.
+	unsigned short used[LEAF_HUGE_PAGES];
+};
+
+struct span_node {
+	struct span_leaf *leaves[SPAN_MAP_SIZE];
+};
+
+struct page_heap {
+	// Free spans of 1 to SPAN_LISTS - 1 pages, then of more pages.
+	struct span *free[SPAN_LISTS];
+	unsigned long nonempty[SPAN_LISTS / BITS_PER_LONG];
+	size_t total_pages;
+	size_t free_pages;
+	size_t dirty_pages;
+
+	// Unused span structures, and the rest of the last batch mapped.
+	struct span *spare;
+	struct span *batch;
+	size_t batch_left;
+};
+
+struct span_node *span_map[SPAN_MAP_SIZE];
+struct page_heap page_heap;
+pthread_mutex_t page_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Maps a zeroed table of the radix map.
+ * @return the table, or NULL on failure.
+ */
+void *span_map_table(size_t size)
+{
+	void *table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (table == MAP_FAILED)
+		return NULL;
+
+	STATS_ADD(nmmap, 1);
+
+	return table;
+}
+
+/**
+ * @return the leaf of the radix map holding page, or NULL if there is
+ * none.
+ */
+struct span_leaf *span_leaf_of(uintptr_t page)
+{
+	if (page >> (3 * SPAN_MAP_BITS))
+		return NULL;
+
+	struct span_node *node = __atomic_load_n(&span_map[page >> (2 * SPAN_MAP_BITS)],
+											 __ATOMIC_ACQUIRE);
+
+	if (!node)
+		return NULL;
+
+	return __atomic_load_n(&node->leaves[(page >> SPAN_MAP_BITS) & SPAN_MAP_MASK],
+						   __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @return the span of page, or NULL if it is not a page of the page
+ * heap. The span is only up to date for the first and the last page of
+ * a span.
+ */
+struct span *span_lookup(uintptr_t page)
+{
+	struct span_leaf *leaf = span_leaf_of(page);
+
+	if (!leaf)
+		return NULL;
+
+	return __atomic_load_n(&leaf->spans[page & SPAN_MAP_MASK], __ATOMIC_RELAXED);
+}
+
+/**
+ * @return the counter of the pages in use of the huge page of page.
+ */
+unsigned short *huge_page_used(uintptr_t page)
+{
+	struct span_leaf *leaf = span_leaf_of(page);
+
+	return &leaf->used[(page & SPAN_MAP_MASK) / HUGE_PAGE_PAGES];
+}
+
+/**
+ * Counts npages pages from page as taken out of the free spans, or as
+ * given back to them, in their huge pages.
+ */
+void huge_pages_account(uintptr_t page, size_t npages, int in_use)
+{
+	while (npages) {
+		size_t count = HUGE_PAGE_PAGES - (page & (HUGE_PAGE_PAGES - 1));
+
+		if (count > npages)
+			count = npages;
+
+		if (in_use)
+			*huge_page_used(page) += count;
+		else
+			*huge_page_used(page) -= count;
+
+		page += count;
+		npages -= count;
+	}
+}
+
+/**
+ * Points page to span in the radix map, creating its tables if needed.
+ * The lock must be held.
+ * @return 1 for success, 0 otherwise.
+ */
+int span_map_set(uintptr_t page, struct span *span)
+{
+	struct span_node **node = &span_map[page >> (2 * SPAN_MAP_BITS)];
+
+	if (!*node) {
+		struct span_node *table = span_map_table(sizeof(struct span_node));
+
+		if (!table)
+			return 0;
+
+		__atomic_store_n(node, table, __ATOMIC_RELEASE);
+	}
+
+	struct span_leaf **leaf = &(*node)->leaves[(page >> SPAN_MAP_BITS) & SPAN_MAP_MASK];
+
+	if (!*leaf) {
+		struct span_leaf *table = span_map_table(sizeof(struct span_leaf));
+
+		if (!table)
+			return 0;
+
+		__atomic_store_n(leaf, table, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&(*leaf)->spans[page & SPAN_MAP_MASK], span, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+/**
+ * Points the first and the last page of span to it. Their tables exist
+ * since the chunk of the span was mapped.
+ */
+void span_map_ends(struct span *span)
+{
+	span_map_set(span->page, span);
+	span_map_set(span->page + span->npages - 1, span);
+}
+
+/**
+ * @return an unused span structure, or NULL on failure. The lock must be
+ * held.
+ */
+struct span *span_new(void)
+{
+	struct span *span = page_heap.spare;
+
+	if (span) {
+		page_heap.spare = span->next;
+		return span;
+	}
+
+	if (!page_heap.batch_left) {
+		page_heap.batch = span_map_table(SPAN_BATCH_SIZE);
+		if (!page_heap.batch)
+			return NULL;
+
+		page_heap.batch_left = SPAN_BATCH_SIZE / sizeof(struct span);
+	}
+
+	page_heap.batch_left--;
+
+	return page_heap.batch++;
+}
+
+void span_delete(struct span *span)
+{
+	span->next = page_heap.spare;
+	page_heap.spare = span;
+}
+
+unsigned int span_list(size_t npages)
+{
+	return npages < SPAN_LISTS ? npages : 0;
+}
+
+void span_insert(struct span *span)
+{
+	unsigned int list = span_list(span->npages);
+	struct span **head = &page_heap.free[list];
+
+	span->state = SPAN_FREE;
+	span->next = *head;
+	span->prev = NULL;
+	if (*head)
+		(*head)->prev = span;
+	*head = span;
+
+	page_heap.nonempty[list / BITS_PER_LONG] |= 1UL << (list % BITS_PER_LONG);
+	page_heap.free_pages += span->npages;
+	huge_pages_account(span->page, span->npages, 0);
+
+	if (!span->clean)
+		page_heap.dirty_pages += span->npages;
+}
+
+void span_remove(struct span *span)
+{
+	unsigned int list = span_list(span->npages);
+
+	if (span->prev)
+		span->prev->next = span->next;
+	else
+		page_heap.free[list] = span->next;
+
+	if (span->next)
+		span->next->prev = span->prev;
+
+	if (!page_heap.free[list])
+		page_heap.nonempty[list / BITS_PER_LONG] &= ~(1UL << (list % BITS_PER_LONG));
+
+	page_heap.free_pages -= span->npages;
+	huge_pages_account(span->page, span->npages, 1);
+
+	if (!span->clean)
+		page_heap.dirty_pages -= span->npages;
+}
+
+/**
+ * Finds, among the first FILLER_CANDIDATES free spans of at least npages
+ * pages, smallest first, the one starting in the fullest huge page.
+ * @return the span, or NULL if there is none.
+ */
+struct span *span_find_filler(size_t npages)
+{
+	struct span *best = NULL;
+	unsigned int best_used = 0;
+	unsigned int candidates = 0;
+
+	for (unsigned int i = npages < SPAN_LISTS ? npages : SPAN_LISTS; i <= SPAN_LISTS; i++) {
+		// The list of the big spans comes last.
+		unsigned int list = i < SPAN_LISTS ? i : 0;
+
+		for (struct span *iterator = page_heap.free[list]; iterator;
+			 iterator = iterator->next) {
+			if (iterator->npages < npages)
+				continue;
+
+			unsigned int used = *huge_page_used(iterator->page);
+
+			if (!best || used > best_used) {
+				best = iterator;
+				best_used = used;
+			}
+
+			if (++candidates == FILLER_CANDIDATES)
+				return best;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Finds the smallest free span of at least npages pages, the lowest on
+ * ties among the big ones.
+ * @return the span, or NULL if there is none.
+ */
+struct span *span_find(size_t npages)
+{
+	if (conf.hugepage_filler && npages < HUGE_PAGE_PAGES)
+		return span_find_filler(npages);
+
+	for (unsigned int word = npages / BITS_PER_LONG;
+		 npages < SPAN_LISTS && word < SPAN_LISTS / BITS_PER_LONG; word++) {
+		unsigned long mask = page_heap.nonempty[word];
+
+		if (word == npages / BITS_PER_LONG)
+			mask &= ~0UL << (npages % BITS_PER_LONG);
+
+		if (mask)
+			return page_heap.free[word * BITS_PER_LONG + __builtin_ctzl(mask)];
+	}
+
+	struct span *best = NULL;
+
+	for (struct span *iterator = page_heap.free[0]; iterator; iterator = iterator->next) {
+		if (iterator->npages >= npages &&
+			(!best || iterator->npages < best->npages ||
+			 (iterator->npages == best->npages && iterator->page < best->page)))
+			best = iterator;
+	}
+
+	return best;
+}
+
+/**
+ * Merges span with the free spans around it and makes it free. The lock
+ * must be held.
+ */
+void span_release(struct span *span)
+{
+	struct span *prev = span_lookup(span->page - 1);
+	struct span *next = span_lookup(span->page + span->npages);
+
+	if (prev && prev->state == SPAN_FREE && prev->page + prev->npages == span->page) {
+		span_remove(prev);
+		prev->npages += span->npages;
+		prev->clean = prev->clean && span->clean;
+		span_delete(span);
+		span = prev;
+	}
+
+	if (next && next->state == SPAN_FREE && next->page == span->page + span->npages) {
+		span_remove(next);
+		span->npages += next->npages;
+		span->clean = span->clean && next->clean;
+		span_delete(next);
+	}
+
+	span_map_ends(span);
+	span_insert(span);
+}
+
+/**
+ * Gives the pages of span past its first npages back as a free span,
+ * merged with the free span after it. The lock must be held.
+ */
+void span_trim(struct span *span, size_t npages)
+{
+	if (span->npages <= npages)
+		return;
+
+	struct span *rest = span_new();
+
+	// Without a structure for the rest, the span keeps all its pages.
+	if (!rest)
+		return;
+
+	rest->page = span->page + npages;
+	rest->npages = span->npages - npages;
+	rest->clean = span->clean;
+	span->npages = npages;
+
+	span_map_ends(span);
+	span_map_ends(rest);
+	span_release(rest);
+}
+
+/**
+ * Maps a chunk of at least npages pages and adds it to the free spans.
+ * The lock must be held.
+ * @return 1 for success, 0 otherwise.
+ */
+int page_heap_grow(size_t npages)
+{
+	size_t size = npages << SPAN_PAGE_SHIFT;
+	size_t chunk_size = (size + PAGE_HEAP_CHUNK - 1) & ~(PAGE_HEAP_CHUNK - 1);
+	char *chunk = conf.thp ? thp_map(chunk_size) : huge_map(chunk_size);
+
+	if (chunk == MAP_FAILED)
+		return 0;
+
+	STATS_ADD(mapped_size, chunk_size);
+
+	struct span *span = span_new();
+	uintptr_t first = (uintptr_t)chunk >> SPAN_PAGE_SHIFT;
+	size_t chunk_pages = chunk_size >> SPAN_PAGE_SHIFT;
+	size_t mapped = 0;
+
+	while (span && mapped < chunk_pages && span_map_set(first + mapped, span))
+		mapped++;
+
+	// Pages left in the map would be taken for the page heap's once
+	// the chunk is unmapped.
+	if (mapped < chunk_pages) {
+		while (mapped)
+			span_map_set(first + --mapped, NULL);
+
+		if (span)
+			span_delete(span);
+
+		thp_own((uintptr_t)chunk, (uintptr_t)chunk + chunk_size, 0);
+		DIE(munmap(chunk, chunk_size) == -1, "Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+		STATS_SUB(mapped_size, chunk_size);
+		return 0;
+	}
+
+	span->page = first;
+	span->npages = chunk_pages;
+	span->clean = 1;
+
+	// The chunk is accounted as in use, then freed.
+	huge_pages_account(first, chunk_pages, 1);
+	span_release(span);
+
+	page_heap.total_pages += chunk_pages;
+
+	return 1;
+}
+
+/**
+ * Returns the pages of the dirty spans of a free list to the OS with
+ * MADV_DONTNEED, until at most limit pages are left dirty. The lock must
+ * be held.
+ */
+void span_list_purge(unsigned int list, size_t limit)
+{
+	for (struct span *iterator = page_heap.free[list];
+		 iterator && page_heap.dirty_pages > limit; iterator = iterator->next) {
+		if (iterator->clean)
+			continue;
+
+		if (madvise((void *)(iterator->page << SPAN_PAGE_SHIFT),
+					iterator->npages << SPAN_PAGE_SHIFT, MADV_DONTNEED) != 0)
+			continue;
+
+		iterator->clean = 1;
+		page_heap.dirty_pages -= iterator->npages;
+		STATS_ADD(npurged, iterator->npages);
+	}
+}
+
+/**
+ * @return the number of free pages the page heap keeps dirty, a quarter
+ * of the pages in use but at least PAGE_HEAP_DIRTY_MIN bytes.
+ */
+size_t page_heap_dirty_max(void)
+{
+	size_t used = (page_heap.total_pages - page_heap.free_pages) / 4;
+	size_t min = PAGE_HEAP_DIRTY_MIN >> SPAN_PAGE_SHIFT;
+
+	return used > min ? used : min;
+}
+
+/**
+ * Purges the whole huge pages of a dirty free span. The span is split
+ * at their boundaries, so that they make a clean span of their own. The
+ * lock must be held.
+ * @return 1 for success, 0 if there is none or on failure.
+ */
+int span_purge_huge(struct span *span)
+{
+	uintptr_t start = (span->page + HUGE_PAGE_PAGES - 1) & ~(HUGE_PAGE_PAGES - 1);
+	uintptr_t end = (span->page + span->npages) & ~(HUGE_PAGE_PAGES - 1);
+
+	if (span->clean || end <= start)
+		return 0;
+
+	struct span *head = start > span->page ? span_new() : NULL;
+	struct span *tail = end < span->page + span->npages ? span_new() : NULL;
+
+	if ((start > span->page && !head) || (end < span->page + span->npages && !tail) ||
+		madvise((void *)(start << SPAN_PAGE_SHIFT), (end - start) << SPAN_PAGE_SHIFT,
+				MADV_DONTNEED) != 0) {
+		if (head)
+			span_delete(head);
+		if (tail)
+			span_delete(tail);
+		return 0;
+	}
+
+	STATS_ADD(npurged, end - start);
+
+	span_remove(span);
+
+	if (head) {
+		head->page = span->page;
+		head->npages = start - span->page;
+		head->clean = 0;
+		span_map_ends(head);
+		span_insert(head);
+	}
+
+	if (tail) {
+		tail->page = end;
+		tail->npages = span->page + span->npages - end;
+		tail->clean = 0;
+		span_map_ends(tail);
+		span_insert(tail);
+	}
+
+	span->page = start;
+	span->npages = end - start;
+	span->clean = 1;
+	span_map_ends(span);
+	span_insert(span);
+
+	return 1;
+}
+
+/**
+ * Purges the biggest dirty free spans first, until at most half of the
+ * dirty pages allowed are left. With hugepage_filler enabled, the whole
+ * free huge pages are purged before any other page. The lock must be
+ * held.
+ */
+void page_heap_purge(void)
+{
+	size_t limit = page_heap_dirty_max() / 2;
+
+	// Only the big spans can hold a whole huge page. The pieces of a
+	// split span are inserted before the next one, so they are skipped.
+	if (conf.hugepage_filler) {
+		struct span *iterator = page_heap.free[0];
+
+		while (iterator && page_heap.dirty_pages > limit) {
+			struct span *next = iterator->next;
+
+			span_purge_huge(iterator);
+			iterator = next;
+		}
+	}
+
+	span_list_purge(0, limit);
+
+	for (unsigned int list = SPAN_LISTS - 1; list > 0; list--)
+		span_list_purge(list, limit);
+}
+
+/**
+ * Counts the huge pages of the page heap, the ones fully in use and the
+ * ones entirely free, and the pages of the spans in use.
+ */
+void page_heap_count(struct os_stats *dest)
+{
+	pthread_mutex_lock(&page_heap_lock);
+
+	for (size_t i = 0; i < SPAN_MAP_SIZE; i++) {
+		struct span_node *node = span_map[i];
+
+		for (size_t j = 0; node && j < SPAN_MAP_SIZE; j++) {
+			struct span_leaf *leaf = node->leaves[j];
+
+			for (size_t k = 0; leaf && k < LEAF_HUGE_PAGES; k++) {
+				// Every page of a chunk is in the map.
+				if (!leaf->spans[k * HUGE_PAGE_PAGES])
+					continue;
+
+				dest->huge_pages++;
+				if (leaf->used[k] == HUGE_PAGE_PAGES)
+					dest->huge_pages_full++;
+				else if (leaf->used[k] == 0)
+					dest->huge_pages_free++;
+			}
+		}
+	}
+
+	dest->span_pages = page_heap.total_pages - page_heap.free_pages;
+
+	pthread_mutex_unlock(&page_heap_lock);
+}
+
+/**
+ * Allocates a span holding size bytes, if size would be mapped.
+ * @return the payload, or NULL if size is not for the page heap or on
+ * failure. *clean tells if the pages are known to be zero.
+ */
+void *page_heap_alloc(size_t size, int *clean)
+{
+	if (size + META_BLOCK_SIZE < conf.mmap_threshold ||
+		size > ((size_t)1 << (3 * SPAN_MAP_BITS + SPAN_PAGE_SHIFT - 1)))
+		return NULL;
+
+	size_t npages = (size + (1UL << SPAN_PAGE_SHIFT) - 1) >> SPAN_PAGE_SHIFT;
+	void *result = NULL;
+
+	pthread_mutex_lock(&page_heap_lock);
+
+	struct span *span = span_find(npages);
+
+	if (!span && page_heap_grow(npages))
+		span = span_find(npages);
+
+	if (span) {
+		span_remove(span);
+		span->state = SPAN_IN_USE;
+		span_trim(span, npages);
+
+		span->size = size;
+		if (clean)
+			*clean = span->clean;
+		span->clean = 0;
+
+		result = (void *)(span->page << SPAN_PAGE_SHIFT);
+	}
+
+	pthread_mutex_unlock(&page_heap_lock);
+
+	return result;
+}
+
+/**
+ * Finds the span whose payload is ptr. The lock must be held.
+ * @return the span, or NULL if ptr is not an allocated span.
+ */
+struct span *page_heap_span(void *ptr)
+{
+	uintptr_t page = (uintptr_t)ptr >> SPAN_PAGE_SHIFT;
+	struct span *span = span_lookup(page);
+
+	if (!span || span->state != SPAN_IN_USE || span->page != page ||
+		((uintptr_t)ptr & ((1UL << SPAN_PAGE_SHIFT) - 1)))
+		return NULL;
+
+	return span;
+}
+
+/**
+ * Frees ptr if it belongs to the page heap.
+ * @return 1 if it does, 0 otherwise.
+ */
+int page_heap_free(void *ptr)
+{
+	if (!span_lookup((uintptr_t)ptr >> SPAN_PAGE_SHIFT))
+		return 0;
+
+	pthread_mutex_lock(&page_heap_lock);
+
+	// Pointers that are not the start of an allocated span are ignored.
+	struct span *span = page_heap_span(ptr);
+
+	if (span) {
+		span_release(span);
+
+		if (page_heap.dirty_pages > page_heap_dirty_max())
+			page_heap_purge();
+	}
+
+	pthread_mutex_unlock(&page_heap_lock);
+
+	return 1;
+}
+
+/**
+ * Grows span in place to npages pages, taking the pages it needs from
+ * the free span after it. The lock must be held.
+ * @return 1 for success, 0 otherwise.
+ */
+int span_grow(struct span *span, size_t npages)
+{
+	if (span->npages >= npages)
+		return 1;
+
+	struct span *next = span_lookup(span->page + span->npages);
+
+	if (!next || next->state != SPAN_FREE || next->page != span->page + span->npages ||
+		span->npages + next->npages < npages)
+		return 0;
+
+	span_remove(next);
+	next->state = SPAN_IN_USE;
+	span_trim(next, npages - span->npages);
+
+	span->npages += next->npages;
+	span_delete(next);
+	span_map_ends(span);
+
+	return 1;
+}
+
+/**
+ * Resizes ptr if it belongs to the page heap. The span gives back the
+ * pages it no longer needs or takes in the free pages after it, otherwise
+ * the block is moved.
+ * @return 1 if ptr belongs to the page heap, with the new payload or NULL
+ * stored in *result, 0 otherwise.
+ */
+int page_heap_realloc(void *ptr, size_t size, void **result)
+{
+	if (!span_lookup((uintptr_t)ptr >> SPAN_PAGE_SHIFT))
+		return 0;
+
+	size_t npages = (size + (1UL << SPAN_PAGE_SHIFT) - 1) >> SPAN_PAGE_SHIFT;
+	size_t old_size = 0;
+
+	pthread_mutex_lock(&page_heap_lock);
+
+	struct span *span = page_heap_span(ptr);
+
+	*result = NULL;
+
+	if (span) {
+		old_size = span->size;
+
+		if (span->npages >= npages)
+			span_trim(span, npages);
+
+		if (span_grow(span, npages)) {
+			span->size = size;
+			*result = ptr;
+		}
+	}
+
+	pthread_mutex_unlock(&page_heap_lock);
+
+	if (!span || *result)
+		return 1;
+
+	*result = os_malloc(size);
+	if (*result) {
+		bulk_copy(*result, ptr, old_size);
+		page_heap_free(ptr);
+	}
+
+	return 1;
+}
+
+/**
+ * Grows ptr in place if it belongs to the page heap, to preferred_size
+ * or else min_size bytes.
+ * @return 1 if ptr belongs to the page heap, with the new size or 0 on
+ * failure stored in *result, 0 otherwise.
+ */
+int page_heap_expand(void *ptr, size_t min_size, size_t preferred_size, size_t *result)
+{
+	if (!span_lookup((uintptr_t)ptr >> SPAN_PAGE_SHIFT))
+		return 0;
+
+	size_t targets[] = { preferred_size, min_size };
+
+	*result = 0;
+
+	pthread_mutex_lock(&page_heap_lock);
+
+	struct span *span = page_heap_span(ptr);
+
+	for (int i = 0; span && i < 2; i++) {
+		size_t npages = (targets[i] + (1UL << SPAN_PAGE_SHIFT) - 1) >> SPAN_PAGE_SHIFT;
+
+		if (span->size >= targets[i] || span_grow(span, npages)) {
+			if (span->size < targets[i])
+				span->size = targets[i];
+			*result = span->size;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&page_heap_lock);
+
+	return 1;
+}
+
+void page_heap_prefork(void)
+{
+	pthread_mutex_lock(&page_heap_lock);
+}
+
+void page_heap_postfork_parent(void)
+{
+	pthread_mutex_unlock(&page_heap_lock);
+}
+
+void page_heap_postfork_child(void)
+{
+	pthread_mutex_init(&page_heap_lock, NULL);
+}
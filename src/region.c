@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * A region hands out memory by bumping a pointer through chunks taken
+ * from os_malloc(), so its objects need no header and are never freed
+ * one by one. The region itself lives at the start of its first chunk,
+ * which is kept by os_region_reset().
+ */
+struct region_chunk {
+	struct region_chunk *next;
+};
+
+struct os_region {
+	struct region_chunk *chunks;
+	char *cur;
+	char *end;
+	size_t chunk_size;
+};
+
+#define REGION_CHUNK_HEADER	ALIGN(sizeof(struct region_chunk))
+#define REGION_HEADER		ALIGN(sizeof(struct os_region))
+
+os_region_t *os_region_create(size_t chunk_size)
+{
+	if (chunk_size == 0)
+		chunk_size = REGION_CHUNK_SIZE;
+
+	size_t first_size = REGION_CHUNK_HEADER + REGION_HEADER + ALIGN(chunk_size);
+	struct region_chunk *chunk = os_malloc(first_size);
+
+	if (!chunk)
+		return NULL;
+
+	os_region_t *region = (os_region_t *)((char *)chunk + REGION_CHUNK_HEADER);
+
+	chunk->next = NULL;
+	region->chunks = chunk;
+	region->chunk_size = ALIGN(chunk_size);
+	region->cur = (char *)region + REGION_HEADER;
+	region->end = (char *)chunk + first_size;
+
+	return region;
+}
+
+/**
+ * Allocates a chunk able to hold size bytes. Requests bigger than the
+ * chunk size get a chunk of their own, linked after the current one so
+ * the free space left in it is still used.
+ * @return the payload of the new chunk, or NULL.
+ */
+void *region_chunk_alloc(os_region_t *region, size_t size)
+{
+	int oversized = size > region->chunk_size;
+	size_t chunk_size = REGION_CHUNK_HEADER + (oversized ? size : region->chunk_size);
+	struct region_chunk *chunk = os_malloc(chunk_size);
+
+	if (!chunk)
+		return NULL;
+
+	char *payload = (char *)chunk + REGION_CHUNK_HEADER;
+
+	if (oversized) {
+		chunk->next = region->chunks->next;
+		region->chunks->next = chunk;
+		return payload;
+	}
+
+	chunk->next = region->chunks;
+	region->chunks = chunk;
+	region->cur = payload + size;
+	region->end = (char *)chunk + chunk_size;
+
+	return payload;
+}
+
+void *os_region_alloc(os_region_t *region, size_t size)
+{
+	if (!region || size == 0)
+		return NULL;
+
+	size = ALIGN(size);
+
+	if (size <= (size_t)(region->end - region->cur)) {
+		void *ptr = region->cur;
+
+		region->cur += size;
+		return ptr;
+	}
+
+	return region_chunk_alloc(region, size);
+}
+
+/**
+ * Returns every chunk but the first one and rewinds the bump pointer
+ * to the start of the first chunk.
+ */
+void os_region_reset(os_region_t *region)
+{
+	if (!region)
+		return;
+
+	struct region_chunk *first = (struct region_chunk *)((char *)region - REGION_CHUNK_HEADER);
+	struct region_chunk *chunk = region->chunks;
+
+	while (chunk != first) {
+		struct region_chunk *next = chunk->next;
+
+		os_free(chunk);
+		chunk = next;
+	}
+
+	// Oversized chunks may have been linked after the first one.
+	chunk = first->next;
+	while (chunk) {
+		struct region_chunk *next = chunk->next;
+
+		os_free(chunk);
+		chunk = next;
+	}
+
+	first->next = NULL;
+	region->chunks = first;
+	region->cur = (char *)region + REGION_HEADER;
+	region->end = region->cur + region->chunk_size;
+}
+
+void os_region_destroy(os_region_t *region)
+{
+	if (!region)
+		return;
+
+	os_region_reset(region);
+	os_free((char *)region - REGION_CHUNK_HEADER);
+}
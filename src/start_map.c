@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+/**
+ * With start_map enabled, a heap with a reserved range records where
+ * its blocks start in a bitmap with one bit per alignment unit of the
+ * range. It only speeds up finding the block of a freed or resized
+ * payload, which then reads one word of the bitmap instead of walking
+ * the list of blocks. Searches, merges and purges read the free blocks
+ * from the side table of block_table.c, if it is enabled.
+ *
+ * The main heap has no reserved range unless vm_heap is set, as
+ * sbrk() gives no bound to size the bitmap for.
+ */
+#define START_MAP_BITS (8 * sizeof(unsigned long))
+
+/**
+ * Maps the bitmap of heap. Its pages are only committed once touched.
+ * @return 1 for success, 0 otherwise.
+ */
+int start_map_create(heap_t *heap)
+{
+	size_t page_size = getpagesize();
+	size_t units = (heap->reserve_end - heap->base) / conf.alignment;
+	size_t size = ((units + 7) / 8 + page_size - 1) & ~(page_size - 1);
+	void *table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (table == MAP_FAILED)
+		return 0;
+
+	STATS_ADD(nmmap, 1);
+
+	heap->start_map = table;
+	heap->start_map_size = size;
+	return 1;
+}
+
+void start_map_destroy(heap_t *heap)
+{
+	if (!heap->start_map)
+		return;
+
+	DIE(munmap(heap->start_map, heap->start_map_size) == -1,
+		"Critical error: munmap() failed.\n");
+
+	STATS_ADD(nmunmap, 1);
+	heap->start_map = NULL;
+}
+
+/**
+ * Records that a block starts, or no longer starts, at block.
+ */
+void start_map_mark(heap_t *heap, block_meta_t *block, int used)
+{
+	if (!heap->start_map)
+		return;
+
+	size_t unit = ((char *)block - heap->base) / conf.alignment;
+	unsigned long mask = 1UL << (unit % START_MAP_BITS);
+
+	if (used)
+		heap->start_map[unit / START_MAP_BITS] |= mask;
+	else
+		heap->start_map[unit / START_MAP_BITS] &= ~mask;
+}
+
+/**
+ * @return the block of heap whose payload is ptr, or NULL. The caller
+ * must make sure that ptr lies in the committed part of the range.
+ */
+block_meta_t *start_map_lookup(heap_t *heap, void *ptr)
+{
+	char *block = (char *)ptr - META_BLOCK_SIZE;
+
+	if (block < heap->base || (block - heap->base) % conf.alignment)
+		return NULL;
+
+	size_t unit = (block - heap->base) / conf.alignment;
+
+	if (!(heap->start_map[unit / START_MAP_BITS] & (1UL << (unit % START_MAP_BITS))))
+		return NULL;
+
+	return (block_meta_t *)block;
+}
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "utils_src.h"
+
+struct os_stats stats;
+
+/**
+ * Copies the allocator statistics into @dest. The counters are only
+ * updated when statistics are enabled ("stats:1" in OSMEM_CONF or
+ * os_mallopt(OS_M_STATS, 1) before the first allocation).
+ * The number of huge pages backing the allocator's memory is read
+ * from /proc/self/smaps when requested, the pages of the free heap
+ * blocks are counted in each purge state and the huge pages of the page
+ * heap by how much of them is in use.
+ */
+void os_stats_get(struct os_stats *dest)
+{
+	if (!dest)
+		return;
+
+	*dest = stats;
+
+	if (conf.stats_enabled && conf.thp)
+		dest->thp_backed = thp_backed_pages();
+
+	if (conf.stats_enabled) {
+		size_t npages[PURGE_STATES] = { 0 };
+
+		decay_count_pages(npages);
+		dest->dirty_pages = npages[PURGE_DIRTY];
+		dest->muzzy_pages = npages[PURGE_MUZZY];
+		dest->clean_pages = npages[PURGE_CLEAN];
+
+		page_heap_count(dest);
+	}
+}
@@ -0,0 +1,458 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/sysinfo.h>
+
+#include "utils_src.h"
+
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define OSMEM_HAVE_RSEQ 1
+#endif
+
+/**
+ * Small freed blocks are kept in LIFO lists per size class, without
+ * returning them to their heap, and are handed out again without
+ * taking any lock. Cached blocks keep STATUS_ALLOC, so their heap never
+ * coalesces them. A cached payload holds the next block in its first
+ * word and, in the per-CPU lists, the list length in the second one.
+ */
+struct tcache {
+	void *heads[TCACHE_CLASS_COUNT];
+	unsigned int counts[TCACHE_CLASS_COUNT];
+	struct tcache *next;
+};
+
+struct percpu_cache {
+	void *heads[TCACHE_CLASS_COUNT];
+} __attribute__((aligned(64)));
+
+#define TCACHE_NEXT(ptr) (((void **)(ptr))[0])
+#define TCACHE_DEPTH(ptr) (((size_t *)(ptr))[1])
+
+int tcache_mode;
+pthread_once_t tcache_init_once = PTHREAD_ONCE_INIT;
+pthread_key_t tcache_key;
+
+// Per-thread caches, linked so they can be reset in a forked child.
+struct tcache *tcache_list;
+pthread_mutex_t tcache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct tcache *thread_cache;
+
+struct percpu_cache *percpu_caches;
+int percpu_nr;
+
+int tcache_class(size_t size)
+{
+	if (size < TCACHE_MIN_SIZE || size > TCACHE_MAX_SIZE)
+		return -1;
+
+	return (size - TCACHE_MIN_SIZE) / conf.alignment;
+}
+
+#ifdef OSMEM_HAVE_RSEQ
+
+#define RSEQ_CS_OFFSET		8
+#define RSEQ_CPU_ID_OFFSET	4
+#define RSEQ_STR_(x)		#x
+#define RSEQ_STR(x)		RSEQ_STR_(x)
+
+/*
+ * Each critical section registers its descriptor in the rseq area of
+ * the thread, checks that it still runs on cpu and ends with a single
+ * store. If the thread is preempted, migrated or signaled before that
+ * store, the kernel moves it to the abort label, which must be preceded
+ * by RSEQ_SIG.
+ */
+#define RSEQ_CS_BEGIN							\
+	".pushsection __rseq_cs, \"aw\"\n\t"				\
+	".balign 32\n\t"						\
+	"3:\n\t"							\
+	".long 0x0, 0x0\n\t"						\
+	".quad 1f, (2f - 1f), 4f\n\t"					\
+	".popsection\n\t"						\
+	"leaq 3b(%%rip), %%rax\n\t"					\
+	"movq %%rax, %%fs:" RSEQ_STR(RSEQ_CS_OFFSET) "(%[rseq_offset])\n\t" \
+	"1:\n\t"							\
+	"cmpl %[cpu], %%fs:" RSEQ_STR(RSEQ_CPU_ID_OFFSET) "(%[rseq_offset])\n\t" \
+	"jnz 4f\n\t"
+
+#define RSEQ_CS_END							\
+	"2:\n\t"							\
+	".pushsection __rseq_failure, \"ax\"\n\t"			\
+	".byte 0x0f, 0xb9, 0x3d\n\t"					\
+	".long " RSEQ_STR(RSEQ_SIG) "\n\t"				\
+	"4:\n\t"							\
+	"jmp %l[abort]\n\t"						\
+	".popsection\n\t"
+
+struct rseq *rseq_area(void)
+{
+	char *thread_pointer;
+
+	__asm__ ("movq %%fs:0, %0" : "=r" (thread_pointer));
+	return (struct rseq *)(thread_pointer + __rseq_offset);
+}
+
+/**
+ * Replaces *head with new_head if it still is expected and the thread
+ * runs on cpu.
+ * @return 0 on success, 1 if the caller must retry.
+ */
+static inline int rseq_cmpeq_store(void **head, void *expected, void *new_head, int cpu)
+{
+	__asm__ __volatile__ goto (
+		RSEQ_CS_BEGIN
+		"cmpq %[head], %[expected]\n\t"
+		"jnz %l[abort]\n\t"
+		"movq %[new_head], %[head]\n\t"
+		RSEQ_CS_END
+		:
+		: [cpu] "r" (cpu),
+		  [rseq_offset] "r" (__rseq_offset),
+		  [head] "m" (*head),
+		  [expected] "r" (expected),
+		  [new_head] "r" (new_head)
+		: "memory", "cc", "rax"
+		: abort);
+	return 0;
+abort:
+	return 1;
+}
+
+/**
+ * Pops the first element of the list at *head, if the thread runs on
+ * cpu. The next pointer is read from the first word of the element.
+ * @return 0 on success, 1 if the caller must retry, 2 if the list is empty.
+ */
+static inline int rseq_pop(void **head, void **popped, int cpu)
+{
+	__asm__ __volatile__ goto (
+		RSEQ_CS_BEGIN
+		"movq %[head], %%rbx\n\t"
+		"testq %%rbx, %%rbx\n\t"
+		"jz %l[empty]\n\t"
+		"movq %%rbx, %[popped]\n\t"
+		"movq (%%rbx), %%rbx\n\t"
+		"movq %%rbx, %[head]\n\t"
+		RSEQ_CS_END
+		:
+		: [cpu] "r" (cpu),
+		  [rseq_offset] "r" (__rseq_offset),
+		  [head] "m" (*head),
+		  [popped] "m" (*popped)
+		: "memory", "cc", "rax", "rbx"
+		: abort, empty);
+	return 0;
+abort:
+	return 1;
+empty:
+	return 2;
+}
+
+/**
+ * @return the CPU the thread runs on, or -1 if rseq is not registered.
+ */
+int rseq_current_cpu(void)
+{
+	if (__rseq_size == 0)
+		return -1;
+
+	return (int)__atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED);
+}
+
+void *percpu_cache_get(int class)
+{
+	while (1) {
+		int cpu = rseq_current_cpu();
+		void *ptr;
+
+		if (cpu < 0 || cpu >= percpu_nr)
+			return NULL;
+
+		int ret = rseq_pop(&percpu_caches[cpu].heads[class], &ptr, cpu);
+
+		if (ret == 0)
+			return ptr;
+		if (ret == 2)
+			return NULL;
+	}
+}
+
+int percpu_cache_put(int class, void *ptr)
+{
+	while (1) {
+		int cpu = rseq_current_cpu();
+
+		if (cpu < 0 || cpu >= percpu_nr)
+			return 0;
+
+		void **head = &percpu_caches[cpu].heads[class];
+		void *old_head = __atomic_load_n(head, __ATOMIC_RELAXED);
+		size_t depth = old_head ? TCACHE_DEPTH(old_head) + 1 : 1;
+
+		if (depth > conf.tcache_size)
+			return 0;
+
+		// Both stores only touch the block being cached.
+		TCACHE_NEXT(ptr) = old_head;
+		TCACHE_DEPTH(ptr) = depth;
+
+		if (rseq_cmpeq_store(head, old_head, ptr, cpu) == 0)
+			return 1;
+	}
+}
+
+/**
+ * Allocates one cache per possible CPU, if the C library registered
+ * rseq for the threads.
+ * @return 1 for success, 0 otherwise.
+ */
+int percpu_cache_init(void)
+{
+	if (rseq_current_cpu() < 0)
+		return 0;
+
+	int nr = get_nprocs_conf();
+	void *caches = mmap(NULL, nr * sizeof(struct percpu_cache), PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (caches == MAP_FAILED)
+		return 0;
+
+	STATS_ADD(nmmap, 1);
+
+	percpu_caches = caches;
+	percpu_nr = nr;
+	return 1;
+}
+
+#else
+
+void *percpu_cache_get(int class)
+{
+	(void)class;
+	return NULL;
+}
+
+int percpu_cache_put(int class, void *ptr)
+{
+	(void)class;
+	(void)ptr;
+	return 0;
+}
+
+int percpu_cache_init(void)
+{
+	return 0;
+}
+
+#endif
+
+/**
+ * Returns every block of cache to the heap that owns it.
+ */
+void tcache_flush(struct tcache *cache)
+{
+	for (int class = 0; class < TCACHE_CLASS_COUNT; class++) {
+		void *ptr = cache->heads[class];
+
+		while (ptr) {
+			void *next = TCACHE_NEXT(ptr);
+			heap_t *heap = heap_of_block(ptr);
+
+			heap_lock(heap);
+			heap_free(heap, ptr);
+			heap_unlock(heap);
+
+			ptr = next;
+		}
+
+		cache->heads[class] = NULL;
+		cache->counts[class] = 0;
+	}
+}
+
+/**
+ * Unlinks cache from the list of per-thread caches.
+ */
+void tcache_unlink(struct tcache *cache)
+{
+	pthread_mutex_lock(&tcache_list_lock);
+
+	struct tcache **iterator = &tcache_list;
+
+	while (*iterator && *iterator != cache)
+		iterator = &(*iterator)->next;
+
+	if (*iterator)
+		*iterator = cache->next;
+
+	pthread_mutex_unlock(&tcache_list_lock);
+}
+
+/**
+ * Thread exit destructor: empties the cache of the thread and frees it.
+ */
+void tcache_destroy(void *arg)
+{
+	struct tcache *cache = arg;
+
+	tcache_unlink(cache);
+	tcache_flush(cache);
+	thread_cache = NULL;
+
+	heap_t *heap = heap_of_block(cache);
+
+	heap_lock(heap);
+	heap_free(heap, cache);
+	heap_unlock(heap);
+}
+
+void tcache_init_routine(void)
+{
+	if (conf.percpu && percpu_cache_init()) {
+		tcache_mode = TCACHE_MODE_PERCPU;
+		return;
+	}
+
+	pthread_key_create(&tcache_key, tcache_destroy);
+	tcache_mode = TCACHE_MODE_THREAD;
+}
+
+/**
+ * @return the cache of the calling thread, created on first use.
+ */
+struct tcache *tcache_get_thread(void)
+{
+	if (thread_cache)
+		return thread_cache;
+
+	// A thread that only frees is not bound to an arena for its cache.
+	heap_t *heap = arena_current();
+
+	if (!heap)
+		heap = main_heap;
+
+	heap_lock(heap);
+	struct tcache *cache = heap_calloc(heap, ALIGN(sizeof(struct tcache)));
+
+	heap_unlock(heap);
+
+	if (!cache)
+		return NULL;
+
+	pthread_mutex_lock(&tcache_list_lock);
+	cache->next = tcache_list;
+	tcache_list = cache;
+	pthread_mutex_unlock(&tcache_list_lock);
+
+	pthread_setspecific(tcache_key, cache);
+	thread_cache = cache;
+
+	return cache;
+}
+
+/**
+ * Takes a block of exactly aligned_size bytes from the cache.
+ * @return the payload, or NULL if the cache has none.
+ */
+void *tcache_get(size_t aligned_size)
+{
+	int class = tcache_class(aligned_size);
+
+	if (class < 0)
+		return NULL;
+
+	pthread_once(&tcache_init_once, tcache_init_routine);
+
+	void *ptr = NULL;
+
+	if (tcache_mode == TCACHE_MODE_PERCPU) {
+		ptr = percpu_cache_get(class);
+	} else if (thread_cache && thread_cache->heads[class]) {
+		ptr = thread_cache->heads[class];
+		thread_cache->heads[class] = TCACHE_NEXT(ptr);
+		thread_cache->counts[class]--;
+	}
+
+	if (ptr)
+		STATS_ADD(ncache_hit, 1);
+
+	return ptr;
+}
+
+/**
+ * Puts the freed payload ptr in the cache, if it is a small heap block
+ * and the list of its size class is not full.
+ * @return 1 if the block was cached, 0 otherwise.
+ */
+int tcache_put(void *ptr)
+{
+	block_meta_t *block = (block_meta_t *)((char *)ptr - META_BLOCK_SIZE);
+
+	if (block->status != STATUS_ALLOC)
+		return 0;
+
+	int class = tcache_class(block->size);
+
+	if (class < 0)
+		return 0;
+
+	pthread_once(&tcache_init_once, tcache_init_routine);
+
+	if (tcache_mode == TCACHE_MODE_PERCPU)
+		return percpu_cache_put(class, ptr);
+
+	struct tcache *cache = tcache_get_thread();
+
+	if (!cache || cache->counts[class] >= conf.tcache_size)
+		return 0;
+
+	TCACHE_NEXT(ptr) = cache->heads[class];
+	cache->heads[class] = ptr;
+	cache->counts[class]++;
+
+	return 1;
+}
+
+void tcache_prefork(void)
+{
+	pthread_mutex_lock(&tcache_list_lock);
+}
+
+void tcache_postfork_parent(void)
+{
+	pthread_mutex_unlock(&tcache_list_lock);
+}
+
+/**
+ * Empties and frees the caches of the threads that do not exist in the
+ * child. Their blocks would otherwise be lost for the child's lifetime.
+ */
+void tcache_postfork_child(void)
+{
+	pthread_mutex_init(&tcache_list_lock, NULL);
+
+	struct tcache *cache = tcache_list;
+
+	tcache_list = NULL;
+
+	while (cache) {
+		struct tcache *next = cache->next;
+
+		if (cache == thread_cache) {
+			cache->next = tcache_list;
+			tcache_list = cache;
+		} else {
+			tcache_flush(cache);
+
+			heap_t *heap = heap_of_block(cache);
+
+			heap_lock(heap);
+			heap_free(heap, cache);
+			heap_unlock(heap);
+		}
+
+		cache = next;
+	}
+}
@@ -0,0 +1,282 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "utils_src.h"
+
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+// End of the heap range already advised for huge pages.
+char *thp_heap_end;
+
+// One bit per huge page advised by the allocator, mapped on first use,
+// so that the huge pages of other users of MADV_HUGEPAGE are not counted.
+unsigned long *thp_owned;
+
+/**
+ * @return the bitmap of the huge pages advised by the allocator, mapped
+ * if it was not yet, or NULL if it can not be mapped.
+ */
+unsigned long *thp_owned_map(void)
+{
+	unsigned long *map = __atomic_load_n(&thp_owned, __ATOMIC_ACQUIRE);
+	unsigned long *expected = NULL;
+
+	if (map)
+		return map;
+
+	map = mmap(NULL, THP_OWNED_PAGES / 8, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	STATS_ADD(nmmap, 1);
+
+	// Another thread may have mapped it meanwhile.
+	if (!__atomic_compare_exchange_n(&thp_owned, &expected, map, 0,
+									 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		DIE(munmap(map, THP_OWNED_PAGES / 8) == -1, "Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+		return expected;
+	}
+
+	return map;
+}
+
+/**
+ * Marks the huge pages overlapping [start, end) as advised by the
+ * allocator, or unmarks those starting in it when it is released. A
+ * huge page that starts before a released range still holds the rest of
+ * its mapping.
+ */
+void thp_own(uintptr_t start, uintptr_t end, int owned)
+{
+	unsigned long *map = owned ? thp_owned_map() : __atomic_load_n(&thp_owned, __ATOMIC_ACQUIRE);
+
+	if (!map)
+		return;
+
+	size_t page = (owned ? start : HUGE_ALIGN(start)) >> HUGE_PAGE_SHIFT;
+	size_t last = HUGE_ALIGN(end) >> HUGE_PAGE_SHIFT;
+
+	if (last > THP_OWNED_PAGES)
+		last = THP_OWNED_PAGES;
+
+	for (; page < last; page++) {
+		unsigned long bit = 1UL << (page % BITS_PER_LONG);
+
+		if (owned)
+			__atomic_fetch_or(&map[page / BITS_PER_LONG], bit, __ATOMIC_RELAXED);
+		else
+			__atomic_fetch_and(&map[page / BITS_PER_LONG], ~bit, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @return 1 if any huge page overlapping [start, end) was advised by
+ * the allocator, 0 otherwise.
+ */
+int thp_owns(uintptr_t start, uintptr_t end)
+{
+	unsigned long *map = __atomic_load_n(&thp_owned, __ATOMIC_ACQUIRE);
+
+	if (!map)
+		return 0;
+
+	size_t last = HUGE_ALIGN(end) >> HUGE_PAGE_SHIFT;
+
+	if (last > THP_OWNED_PAGES)
+		last = THP_OWNED_PAGES;
+
+	for (size_t page = start >> HUGE_PAGE_SHIFT; page < last; page++) {
+		if ((__atomic_load_n(&map[page / BITS_PER_LONG], __ATOMIC_RELAXED) >>
+			 (page % BITS_PER_LONG)) & 1)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Marks [addr, addr + len) as eligible for transparent huge pages
+ * and counts the whole huge pages it covers.
+ */
+void thp_advise(void *addr, size_t len)
+{
+	uintptr_t start = (uintptr_t)addr & ~((uintptr_t)getpagesize() - 1);
+	uintptr_t end = (uintptr_t)addr + len;
+
+	// Not supported by the kernel is not an error, it is only a hint.
+	if (madvise((void *)start, end - start, MADV_HUGEPAGE) != 0)
+		return;
+
+	thp_own(start, end, 1);
+
+	uintptr_t huge_start = HUGE_ALIGN(start);
+	uintptr_t huge_end = end & ~((uintptr_t)HUGE_PAGE_SIZE - 1);
+
+	if (huge_end > huge_start)
+		STATS_ADD(thp_hinted, (huge_end - huge_start) / HUGE_PAGE_SIZE);
+}
+
+/**
+ * Maps size bytes starting on a huge page boundary. The mapping is
+ * over-sized by one huge page and the unaligned head and tail are
+ * unmapped, so the block can be released with a single munmap().
+ * @return the start of the mapping, or MAP_FAILED.
+ */
+void *huge_map(size_t size)
+{
+	size_t page_size = getpagesize();
+	size_t map_size = (size + page_size - 1) & ~(page_size - 1);
+	size_t raw_size = map_size + HUGE_PAGE_SIZE - page_size;
+	char *raw = mmap(NULL, raw_size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (raw == MAP_FAILED)
+		return MAP_FAILED;
+
+	STATS_ADD(nmmap, 1);
+
+	char *aligned = (char *)HUGE_ALIGN((uintptr_t)raw);
+	size_t head_size = aligned - raw;
+	size_t tail_size = raw_size - head_size - map_size;
+
+	if (head_size) {
+		DIE(munmap(raw, head_size) == -1, "Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+	}
+
+	if (tail_size) {
+		DIE(munmap(aligned + map_size, tail_size) == -1,
+			"Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+	}
+
+	return aligned;
+}
+
+/**
+ * Maps size bytes starting on a huge page boundary and advises them
+ * for huge pages.
+ * @return the start of the mapping, or MAP_FAILED.
+ */
+void *thp_map(size_t size)
+{
+	size_t page_size = getpagesize();
+	void *addr = huge_map(size);
+
+	if (addr != MAP_FAILED)
+		thp_advise(addr, (size + page_size - 1) & ~(page_size - 1));
+
+	return addr;
+}
+
+/**
+ * Moves the program break to the next huge page boundary, so that
+ * the heap preallocation starts on it.
+ * @return 1 for success, 0 otherwise.
+ */
+int thp_align_heap_start(void)
+{
+	char *brk_end = sbrk(0);
+
+	if (brk_end == (void *) -1)
+		return 0;
+
+	size_t pad = HUGE_ALIGN((uintptr_t)brk_end) - (uintptr_t)brk_end;
+
+	if (pad) {
+		if (sbrk(pad) == (void *) -1)
+			return 0;
+
+		STATS_ADD(nsbrk, 1);
+	}
+
+	thp_heap_end = brk_end + pad;
+	return 1;
+}
+
+/**
+ * Advises the part of the heap between the previously advised end
+ * and heap_end, so the growth of the heap is backed by huge pages too.
+ */
+void thp_advise_heap(void *heap_end)
+{
+	if (!thp_heap_end || (char *)heap_end <= thp_heap_end)
+		return;
+
+	thp_advise(thp_heap_end, (char *)heap_end - thp_heap_end);
+	thp_heap_end = heap_end;
+}
+
+/**
+ * Sums the AnonHugePages of the mappings advised with MADV_HUGEPAGE
+ * ("hg" in VmFlags) in /proc/self/smaps that overlap the huge pages the
+ * allocator advised, so those of the program or of other libraries are
+ * left out. The file is read with a stack buffer, as the allocator can
+ * not rely on stdio buffers.
+ * @return the number of huge pages backing the allocator's memory.
+ */
+size_t thp_backed_pages(void)
+{
+	int fd = open("/proc/self/smaps", O_RDONLY);
+
+	if (fd < 0)
+		return 0;
+
+	char buf[4096];
+	size_t len = 0;
+	uintptr_t vma_start = 0;
+	uintptr_t vma_end = 0;
+	size_t vma_huge_kb = 0;
+	size_t total_kb = 0;
+
+	while (1) {
+		ssize_t bytes = read(fd, buf + len, sizeof(buf) - 1 - len);
+
+		if (bytes <= 0)
+			break;
+
+		len += bytes;
+		buf[len] = '\0';
+
+		char *line = buf;
+		char *newline;
+
+		while ((newline = strchr(line, '\n'))) {
+			char *end;
+			uintptr_t start = strtoul(line, &end, 16);
+
+			*newline = '\0';
+
+			// Each mapping starts with a "start-end perms ..." line.
+			if (end != line && *end == '-') {
+				vma_start = start;
+				vma_end = strtoul(end + 1, NULL, 16);
+			} else if (strncmp(line, "AnonHugePages:", 14) == 0) {
+				vma_huge_kb = strtoul(line + 14, NULL, 10);
+			} else if (strncmp(line, "VmFlags:", 8) == 0) {
+				if (vma_huge_kb && strstr(line, " hg") && thp_owns(vma_start, vma_end))
+					total_kb += vma_huge_kb;
+				vma_huge_kb = 0;
+			}
+
+			line = newline + 1;
+		}
+
+		len = buf + len - line;
+		memmove(buf, line, len);
+
+		// Drop lines that do not fit in the buffer.
+		if (len == sizeof(buf) - 1)
+			len = 0;
+	}
+
+	close(fd);
+
+	return total_kb / (HUGE_PAGE_SIZE / 1024);
+}
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stddef.h>
+
+#include "utils_src.h"
+
+/**
+ * A TLSF (two-level segregated fit) pool serves blocks from a single
+ * mapping, populated and locked in memory when the pool is created, so
+ * os_tlsf_malloc() and os_tlsf_free() never make a syscall or fault a
+ * page in. Free blocks are kept in lists by size class: the first level
+ * is the power of two below the size, the second level splits it in
+ * TLSF_SL_COUNT linear steps. One bitmap per level tells which lists are
+ * not empty, so finding a block big enough takes two find-first-set
+ * instructions and every operation runs in constant time.
+ */
+#define TLSF_ALIGN_LOG2		4
+#define TLSF_ALIGN		(1UL << TLSF_ALIGN_LOG2)
+#define TLSF_SL_LOG2		5
+#define TLSF_SL_COUNT		(1U << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT		(TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_FL_MAX		38
+#define TLSF_FL_COUNT		(TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+#define TLSF_SMALL_SIZE		(1UL << TLSF_FL_SHIFT)
+#define TLSF_POOL_MAX		(1UL << (TLSF_FL_MAX - 1))
+
+#define TLSF_FREE		1UL
+
+/**
+ * The previous block in memory is linked from each block, so both
+ * neighbours of a freed block are found right away. The free list links
+ * use the payload of free blocks.
+ */
+struct tlsf_block {
+	struct tlsf_block *prev_phys;
+	size_t size;
+	struct tlsf_block *next_free;
+	struct tlsf_block *prev_free;
+};
+
+#define TLSF_HEADER		offsetof(struct tlsf_block, next_free)
+#define TLSF_MIN_SIZE		(sizeof(struct tlsf_block) - TLSF_HEADER)
+
+struct os_tlsf {
+	unsigned int fl_bitmap;
+	unsigned int sl_bitmap[TLSF_FL_COUNT];
+	struct tlsf_block *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+	size_t map_size;
+};
+
+#define TLSF_POOL_HEADER	((sizeof(struct os_tlsf) + TLSF_ALIGN - 1) & ~(TLSF_ALIGN - 1))
+
+size_t tlsf_size(struct tlsf_block *block)
+{
+	return block->size & ~TLSF_FREE;
+}
+
+struct tlsf_block *tlsf_next_phys(struct tlsf_block *block)
+{
+	return (struct tlsf_block *)((char *)block + TLSF_HEADER + tlsf_size(block));
+}
+
+/**
+ * Finds the list of the blocks of size bytes.
+ */
+void tlsf_mapping(size_t size, unsigned int *fl, unsigned int *sl)
+{
+	if (size < TLSF_SMALL_SIZE) {
+		*fl = 0;
+		*sl = size / (TLSF_SMALL_SIZE / TLSF_SL_COUNT);
+		return;
+	}
+
+	unsigned int msb = 63 - __builtin_clzl(size);
+
+	*sl = (size >> (msb - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+	*fl = msb - TLSF_FL_SHIFT + 1;
+}
+
+void tlsf_insert(os_tlsf_t *pool, struct tlsf_block *block)
+{
+	unsigned int fl, sl;
+
+	tlsf_mapping(tlsf_size(block), &fl, &sl);
+
+	struct tlsf_block *head = pool->blocks[fl][sl];
+
+	block->next_free = head;
+	block->prev_free = NULL;
+	if (head)
+		head->prev_free = block;
+
+	pool->blocks[fl][sl] = block;
+	pool->fl_bitmap |= 1U << fl;
+	pool->sl_bitmap[fl] |= 1U << sl;
+}
+
+void tlsf_remove(os_tlsf_t *pool, struct tlsf_block *block)
+{
+	unsigned int fl, sl;
+
+	tlsf_mapping(tlsf_size(block), &fl, &sl);
+
+	if (block->prev_free)
+		block->prev_free->next_free = block->next_free;
+	else
+		pool->blocks[fl][sl] = block->next_free;
+
+	if (block->next_free)
+		block->next_free->prev_free = block->prev_free;
+
+	if (!pool->blocks[fl][sl]) {
+		pool->sl_bitmap[fl] &= ~(1U << sl);
+		if (!pool->sl_bitmap[fl])
+			pool->fl_bitmap &= ~(1U << fl);
+	}
+}
+
+/**
+ * Finds a free block of at least size bytes. The size is rounded up to
+ * the next list, so that any block of that list fits.
+ * @return the block, or NULL if there is none.
+ */
+struct tlsf_block *tlsf_find(os_tlsf_t *pool, size_t size)
+{
+	unsigned int fl, sl;
+
+	if (size >= TLSF_SMALL_SIZE)
+		size += (1UL << (63 - __builtin_clzl(size) - TLSF_SL_LOG2)) - 1;
+
+	tlsf_mapping(size, &fl, &sl);
+
+	if (fl >= TLSF_FL_COUNT)
+		return NULL;
+
+	unsigned int sl_map = sl < TLSF_SL_COUNT ? pool->sl_bitmap[fl] & (~0U << sl) : 0;
+
+	if (!sl_map) {
+		unsigned int fl_map = fl + 1 < 32 ? pool->fl_bitmap & (~0U << (fl + 1)) : 0;
+
+		if (!fl_map)
+			return NULL;
+
+		fl = __builtin_ctz(fl_map);
+		sl_map = pool->sl_bitmap[fl];
+	}
+
+	return pool->blocks[fl][__builtin_ctz(sl_map)];
+}
+
+/**
+ * Merges block with the free block after it in memory.
+ */
+void tlsf_merge_next(os_tlsf_t *pool, struct tlsf_block *block)
+{
+	struct tlsf_block *next = tlsf_next_phys(block);
+
+	tlsf_remove(pool, next);
+	block->size += TLSF_HEADER + tlsf_size(next);
+	tlsf_next_phys(block)->prev_phys = block;
+}
+
+os_tlsf_t *os_tlsf_create(size_t size)
+{
+	size_t page_size = getpagesize();
+
+	if (size == 0 || size > TLSF_POOL_MAX)
+		return NULL;
+
+	// Reads the configuration, as this may be the first use of the allocator.
+	if (!head_init_done)
+		head_init();
+
+	size = (size + TLSF_ALIGN - 1) & ~(TLSF_ALIGN - 1);
+
+	// The pool header, the first block and the sentinel ending it.
+	size_t map_size = (TLSF_POOL_HEADER + 2 * TLSF_HEADER + size + page_size - 1) &
+					  ~(page_size - 1);
+	os_tlsf_t *pool = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+	if (pool == MAP_FAILED)
+		return NULL;
+
+	STATS_ADD(nmmap, 1);
+	STATS_ADD(mapped_size, map_size);
+
+	// Keeps the pages from being swapped out, if RLIMIT_MEMLOCK allows.
+	mlock(pool, map_size);
+
+	pool->map_size = map_size;
+
+	struct tlsf_block *block = (struct tlsf_block *)((char *)pool + TLSF_POOL_HEADER);
+	struct tlsf_block *sentinel = (struct tlsf_block *)((char *)pool + map_size - TLSF_HEADER);
+
+	block->prev_phys = NULL;
+	block->size = ((char *)sentinel - (char *)block - TLSF_HEADER) | TLSF_FREE;
+	sentinel->prev_phys = block;
+	sentinel->size = 0;
+
+	tlsf_insert(pool, block);
+
+	return pool;
+}
+
+void *os_tlsf_malloc(os_tlsf_t *pool, size_t size)
+{
+	if (!pool || size == 0 || size > TLSF_POOL_MAX)
+		return NULL;
+
+	size = (size + TLSF_ALIGN - 1) & ~(TLSF_ALIGN - 1);
+	if (size < TLSF_MIN_SIZE)
+		size = TLSF_MIN_SIZE;
+
+	struct tlsf_block *block = tlsf_find(pool, size);
+
+	if (!block)
+		return NULL;
+
+	tlsf_remove(pool, block);
+
+	// Split the block if the rest can hold a block of its own.
+	if (tlsf_size(block) >= size + sizeof(struct tlsf_block)) {
+		struct tlsf_block *rest = (struct tlsf_block *)((char *)block + TLSF_HEADER + size);
+
+		rest->prev_phys = block;
+		rest->size = (tlsf_size(block) - size - TLSF_HEADER) | TLSF_FREE;
+		tlsf_next_phys(rest)->prev_phys = rest;
+		block->size = size;
+
+		tlsf_insert(pool, rest);
+	}
+
+	block->size &= ~TLSF_FREE;
+
+	return (char *)block + TLSF_HEADER;
+}
+
+void os_tlsf_free(os_tlsf_t *pool, void *ptr)
+{
+	if (!pool || !ptr)
+		return;
+
+	struct tlsf_block *block = (struct tlsf_block *)((char *)ptr - TLSF_HEADER);
+
+	if (block->size & TLSF_FREE)
+		return;
+
+	block->size |= TLSF_FREE;
+
+	if (tlsf_next_phys(block)->size & TLSF_FREE)
+		tlsf_merge_next(pool, block);
+
+	struct tlsf_block *prev = block->prev_phys;
+
+	if (prev && (prev->size & TLSF_FREE)) {
+		tlsf_remove(pool, prev);
+		prev->size += TLSF_HEADER + tlsf_size(block);
+		tlsf_next_phys(prev)->prev_phys = prev;
+		block = prev;
+	}
+
+	tlsf_insert(pool, block);
+}
+
+void os_tlsf_destroy(os_tlsf_t *pool)
+{
+	if (!pool)
+		return;
+
+	size_t map_size = pool->map_size;
+
+	DIE(munmap(pool, map_size) == -1, "Critical error: munmap() failed.\n");
+
+	STATS_ADD(nmunmap, 1);
+	STATS_SUB(mapped_size, map_size);
+}
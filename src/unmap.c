@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <semaphore.h>
+
+#include "utils_src.h"
+
+/**
+ * With async_munmap enabled, the mappings of freed blocks are not
+ * unmapped by the freeing thread, which would wait for the TLB
+ * shootdowns on every other core, but queued and unmapped in batches
+ * by a background thread. The queue is a lock-free stack linked
+ * through the first bytes of the mappings themselves.
+ */
+struct unmap_node {
+	struct unmap_node *next;
+	size_t size;
+};
+
+struct unmap_node *unmap_queue;
+sem_t unmap_sem;
+
+// 0 before the thread is started, 1 once it runs, -1 if it failed.
+int unmap_thread_state;
+pthread_mutex_t unmap_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Unmaps every mapping queued so far.
+ */
+void unmap_drain(void)
+{
+	struct unmap_node *node = __atomic_exchange_n(&unmap_queue, NULL, __ATOMIC_ACQUIRE);
+
+	while (node) {
+		struct unmap_node *next = node->next;
+
+		DIE(munmap(node, node->size) == -1, "Critical error: munmap() failed.\n");
+		STATS_ADD(nmunmap, 1);
+
+		node = next;
+	}
+}
+
+void *unmap_thread(void *arg)
+{
+	(void)arg;
+
+	while (1) {
+		// Posted whenever a mapping is queued on an empty queue.
+		if (sem_wait(&unmap_sem) == 0)
+			unmap_drain();
+	}
+
+	return NULL;
+}
+
+/**
+ * Starts the background thread on first use.
+ * @return 1 if it runs, 0 otherwise.
+ */
+int unmap_thread_start(void)
+{
+	pthread_mutex_lock(&unmap_thread_lock);
+
+	if (unmap_thread_state == 0) {
+		pthread_t thread;
+		pthread_attr_t attr;
+
+		sem_init(&unmap_sem, 0, 0);
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		if (pthread_create(&thread, &attr, unmap_thread, NULL) == 0)
+			__atomic_store_n(&unmap_thread_state, 1, __ATOMIC_RELEASE);
+		else
+			unmap_thread_state = -1;
+
+		pthread_attr_destroy(&attr);
+	}
+
+	pthread_mutex_unlock(&unmap_thread_lock);
+
+	return unmap_thread_state == 1;
+}
+
+/**
+ * Releases the writable mapping [addr, addr + size), either right away
+ * or through the background thread.
+ */
+void release_mapping(void *addr, size_t size)
+{
+	thp_own((uintptr_t)addr, (uintptr_t)addr + size, 0);
+
+	if (conf.async_munmap &&
+		(__atomic_load_n(&unmap_thread_state, __ATOMIC_ACQUIRE) == 1 || unmap_thread_start())) {
+		struct unmap_node *node = addr;
+		struct unmap_node *old_head = __atomic_load_n(&unmap_queue, __ATOMIC_RELAXED);
+
+		node->size = size;
+		do {
+			node->next = old_head;
+		} while (!__atomic_compare_exchange_n(&unmap_queue, &old_head, node, 1,
+											  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+		if (!old_head)
+			sem_post(&unmap_sem);
+		return;
+	}
+
+	DIE(munmap(addr, size) == -1, "Critical error: munmap() failed.\n");
+	STATS_ADD(nmunmap, 1);
+}
+
+void unmap_prefork(void)
+{
+	pthread_mutex_lock(&unmap_thread_lock);
+}
+
+void unmap_postfork_parent(void)
+{
+	pthread_mutex_unlock(&unmap_thread_lock);
+}
+
+/**
+ * The background thread does not exist in the child: the queued
+ * mappings are released here and the thread is started again on the
+ * next queued free.
+ */
+void unmap_postfork_child(void)
+{
+	pthread_mutex_init(&unmap_thread_lock, NULL);
+
+	if (unmap_thread_state == 1) {
+		sem_destroy(&unmap_sem);
+		unmap_thread_state = 0;
+	}
+
+	unmap_drain();
+}
@@ -1,40 +1,448 @@
 #pragma once
 
 #include <sys/mman.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 
 #include "osmem.h"
 #include "block_meta.h"
 
+// Default values, overridable through OSMEM_CONF or os_mallopt().
 #define HEAP_PREALLOC_SIZE (128 * 1024)
 #define MMAP_THRESHOLD (128 * 1024)
+#define NT_THRESHOLD (1024 * 1024)
+#define ALIGNMENT 8
+#define ARENA_COUNT_MAX 64
+
+// Largest value accepted for the size parameters of the configuration.
+#define CONF_SIZE_MAX (1L << 40)
+
+// Smallest non-zero nt_threshold, a few of the widest vector stores.
+#define NT_THRESHOLD_MIN 256
+
+// Address space reserved for each arena other than the main one.
+#define ARENA_RESERVE_SIZE (64 * 1024 * 1024)
+
+// Owner id of the blocks of heaps created with os_heap_create().
+#define HEAP_ID_USER ARENA_COUNT_MAX
+
+// Block sizes kept in the thread and CPU caches. There is a class per
+// alignment unit, so the classes counted for the smallest alignment
+// are enough for any configured one.
+#define TCACHE_MIN_SIZE 16
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_CLASS_COUNT ((TCACHE_MAX_SIZE - TCACHE_MIN_SIZE) / ALIGNMENT + 1)
+
+// Most blocks kept per size class in each cache, as in glibc. Cached
+// blocks stay out of the heap and are never coalesced.
+#define TCACHE_SIZE_MAX 65535
+
+#define TCACHE_MODE_THREAD 0
+#define TCACHE_MODE_PERCPU 1
+
+// Default size of the chunks regions take from os_malloc().
+#define REGION_CHUNK_SIZE (64 * 1024)
+
+// Buckets of the hash table of page aligned blocks.
+#define PAGE_BLOCK_HASH_BITS 10
+#define PAGE_BLOCK_BUCKETS (1 << PAGE_BLOCK_HASH_BITS)
+
+// Bytes of page block headers mapped at a time.
+#define PAGE_BLOCK_BATCH_SIZE (16 * 1024)
+
+// Initial buckets of the hash table of mapped blocks of each heap. The
+// table doubles once it holds more blocks than buckets.
+#define MAPPED_HASH_BITS 8
+#define MAPPED_BUCKETS (1 << MAPPED_HASH_BITS)
+
+// Purge states of the pages of free heap blocks.
+#define PURGE_DIRTY 0
+#define PURGE_MUZZY 1
+#define PURGE_CLEAN 2
+#define PURGE_STATES 3
+
+// Epochs per decay time, and bounds of the sleep of the purging thread.
+#define DECAY_STEPS 20
+#define DECAY_INTERVAL_MIN_MS 10
+#define DECAY_INTERVAL_MAX_MS 1000
+
+// Largest payload kept in the fastbins, and number of fastbins for the
+// smallest alignment, enough for any configured one.
+#define FASTBIN_MAX_SIZE 128
+#define FASTBIN_COUNT (FASTBIN_MAX_SIZE / ALIGNMENT)
+
+// Requests from which the fastbins are released before the search, as
+// glibc does for large bin requests.
+#define FASTBIN_CONSOLIDATE_SIZE 1024
+
+// Sets of the table of growing blocks of each heap, and slots per set.
+#define GROW_HASH_BITS 4
+#define GROW_SETS (1 << GROW_HASH_BITS)
+#define GROW_WAYS 4
+
+// Smallest block of the buddy zone, and size of the zone.
+#define BUDDY_MIN_LOG2 12
+#define BUDDY_MIN_SIZE (1UL << BUDDY_MIN_LOG2)
+#define BUDDY_ZONE_LOG2 26
+#define BUDDY_ZONE_SIZE (1UL << BUDDY_ZONE_LOG2)
+
+// Free buddy blocks of at least this order have their pages returned to
+// the OS.
+#define BUDDY_PURGE_LOG2 20
+
+#define HUGE_PAGE_SHIFT 21
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGE_ALIGN(size) (((size) + (HUGE_PAGE_SIZE - 1)) & ~(HUGE_PAGE_SIZE - 1))
+
+// Huge pages of the 128 TiB user address space, tracked by thp_own().
+#define THP_OWNED_PAGES (1UL << (47 - HUGE_PAGE_SHIFT))
+
+// Pages of the page heap, free lists of spans by number of pages, and
+// bytes of span structures mapped at a time.
+#define SPAN_PAGE_SHIFT 12
+#define SPAN_LISTS 128
+#define SPAN_BATCH_SIZE (64 * 1024)
+
+// Steps in which the page heap grows, and the least free memory it keeps
+// without returning it to the OS.
+#define PAGE_HEAP_CHUNK HUGE_PAGE_SIZE
+#define PAGE_HEAP_DIRTY_MIN (16 * 1024 * 1024)
+
+// Free spans the huge page filler compares for each request.
+#define FILLER_CANDIDATES 16
 
 typedef struct block_meta block_meta_t;
+typedef struct heap heap_t;
+struct free_node;
+struct block_entry;
+
+/**
+ * A block resized by os_realloc(), with the size last requested for it,
+ * the number of times in a row it grew and when it was last resized.
+ */
+struct grow_slot {
+	block_meta_t *block;
+	size_t size;
+	unsigned int streak;
+	unsigned long used;
+};
+
+/**
+ * Decay state of one purge stage of a heap: the pages that became
+ * unpurged during each of the last DECAY_STEPS epochs, newest first.
+ */
+struct decay {
+	size_t backlog[DECAY_STEPS];
+	size_t nunpurged;
+	uint64_t epoch_start;
+};
+
+/**
+ * A heap is a list of blocks protected by a lock. The main heap grows
+ * with sbrk(), every other heap commits pages of its own reserved range.
+ * Mapped blocks are kept in a hash table of the heap that created them.
+ */
+struct heap {
+	block_meta_t head;
+	pthread_mutex_t lock;
+	unsigned short id;
+	int prealloc_done;
+
+	// Reserved range, unused by the main heap.
+	char *base;
+	char *end;
+	char *commit_end;
+	char *reserve_end;
+
+	// Payloads freed by threads of other arenas, linked through
+	// their first word and pushed without taking the lock.
+	void *remote_frees;
+
+	// Next heap created with os_heap_create().
+	heap_t *next;
+
+	// Root of the tree of free blocks, with free_tree enabled.
+	struct free_node *free_tree;
+
+	// Free blocks in address order, with block_table enabled, in a
+	// table of block_table_cap entries mapped once one is indexed.
+	struct block_entry *block_table;
+	size_t block_table_len;
+	size_t block_table_cap;
+
+	// Block handed out last by the next fit policy.
+	block_meta_t *rover;
+
+	// Mapped blocks, hashed by address into 1 << mapped_bits buckets.
+	// The table is mapped_inline until it first grows.
+	block_meta_t **mapped;
+	unsigned int mapped_bits;
+	size_t mapped_count;
+	block_meta_t *mapped_inline[MAPPED_BUCKETS];
+
+	// Bitmap of the block starts in the reserved range, with
+	// start_map enabled.
+	unsigned long *start_map;
+	size_t start_map_size;
+
+	// Decay of the dirty, then of the muzzy pages of free blocks.
+	struct decay decay[PURGE_CLEAN];
+
+	// Blocks recently grown by os_realloc(), with grow_streak set.
+	struct grow_slot grow[GROW_SETS][GROW_WAYS];
+	unsigned long grow_clock;
+
+	// Freed small blocks per payload size, with fastbins enabled.
+	block_meta_t *fastbins[FASTBIN_COUNT];
+	unsigned long fastbin_blocks;
+};
+
+struct osmem_conf {
+	size_t prealloc_size;
+	size_t mmap_threshold;
+	size_t trim_threshold;
+	size_t alignment;
+	unsigned int arena_count;
+	unsigned int tcache_size;
+	long dirty_decay_ms;
+	long muzzy_decay_ms;
+	int stats_enabled;
+	int thp;
+	int remote_free;
+	int percpu;
+	size_t vm_heap;
+	int free_tree;
+	int block_table;
+	int fit_policy;
+	int start_map;
+	int page_align;
+	int async_munmap;
+	int background_thread;
+	size_t nt_threshold;
+	size_t mmap_hysteresis;
+	unsigned int grow_streak;
+	size_t map_headroom;
+	int fastbins;
+	int buddy;
+	int page_heap;
+	int hugepage_filler;
+};
+
+extern struct osmem_conf conf;
+extern struct os_stats stats;
+extern int head_init_done;
+
+extern heap_t arenas[ARENA_COUNT_MAX];
+extern unsigned int arena_nr;
+
+extern heap_t *user_heaps;
+extern pthread_mutex_t user_heaps_lock;
+
+#define main_heap (&arenas[0])
 
 // Taken from "Resources" -> "Implementing malloc"
-#define ALIGNMENT 8
-#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
+#define ALIGN(size) (((size) + (conf.alignment - 1)) & ~(conf.alignment - 1))
 
 #define META_BLOCK_SIZE ALIGN(sizeof(struct block_meta))
 
+// Bounds of the search of the good fit policy.
+#define GOOD_FIT_CANDIDATES 8
+#define GOOD_FIT_SLACK 8
+
+// Smallest payload of a heap block when free blocks are indexed.
+#define FREE_NODE_SIZE ALIGN(4 * sizeof(void *))
+
+#define STATS_ADD(field, value)							\
+	do {									\
+		if (conf.stats_enabled)						\
+			__atomic_fetch_add(&stats.field, (value), __ATOMIC_RELAXED);	\
+	} while (0)
+
+#define STATS_SUB(field, value)							\
+	do {									\
+		if (conf.stats_enabled)						\
+			__atomic_fetch_sub(&stats.field, (value), __ATOMIC_RELAXED);	\
+	} while (0)
+
+/**
+ * Multiplicative hash of an address, for the tables keyed by blocks.
+ * The low shift bits, the same for all keys, are dropped first.
+ * @return a hash of bits bits.
+ */
+static inline size_t ptr_hash(const void *ptr, unsigned int shift, unsigned int bits)
+{
+	uint64_t key = (uintptr_t)ptr >> shift;
+
+	return (key * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+void conf_init(void);
+int conf_set(int param, long value);
+
 void head_init(void);
-void list_add_last(block_meta_t *block);
+void heap_init(heap_t *heap, unsigned short id);
+void list_add_last(heap_t *heap, block_meta_t *block);
 void list_remove_block(block_meta_t *block);
 
-block_meta_t *map_block_in_mem(size_t size);
-int prealloc_heap_attempt(void);
-block_meta_t *find_best_block(size_t size);
-void split_block_attempt(block_meta_t *block, size_t size);
-block_meta_t *expand_last_block(size_t size);
-void coalesce_blocks(block_meta_t *block1, block_meta_t *block2);
-void coalesce_attempt(void);
-block_meta_t *search_block_in_list(void *ptr);
-block_meta_t *get_free_heap_block(size_t size);
-block_meta_t *get_last_on_heap(void);
-
-void delete_mapped_block(block_meta_t *block);
+heap_t *arena_get(void);
+heap_t *arena_current(void);
+heap_t *heap_of_block(void *ptr);
+int heap_maps_overflow(heap_t *heap);
+void *arena_overflow_realloc(heap_t *arena, void *ptr, size_t size);
+void heap_lock(heap_t *heap);
+void heap_unlock(heap_t *heap);
+int vm_heap_reserve(heap_t *heap, size_t size);
+void *vm_heap_grow(heap_t *heap, size_t increment);
+int vm_heap_shrink(heap_t *heap, size_t decrement);
+void remote_free_push(heap_t *heap, void *ptr);
+void remote_free_drain(heap_t *heap);
+
+void osmem_prefork(void);
+void osmem_postfork_parent(void);
+void osmem_postfork_child(void);
+
+void user_heaps_prefork(void);
+void user_heaps_postfork_parent(void);
+void user_heaps_postfork_child(void);
+
+block_meta_t *map_block_in_mem(heap_t *heap, size_t size);
+int mapping_grow(void *end, size_t len);
+void *heap_grow(heap_t *heap, size_t increment);
+int heap_shrink(heap_t *heap, block_meta_t *block);
+int prealloc_heap_attempt(heap_t *heap);
+block_meta_t *find_best_block(heap_t *heap, size_t size);
+void split_block_attempt(heap_t *heap, block_meta_t *block, size_t size);
+size_t block_payload_size(size_t size);
+block_meta_t *prev_heap_block(heap_t *heap, block_meta_t *block);
+block_meta_t *next_heap_block(heap_t *heap, block_meta_t *block);
+void release_heap_block(heap_t *heap, block_meta_t *block);
+int heap_break_moved(heap_t *heap);
+block_meta_t *expand_last_block(heap_t *heap, size_t size);
+block_meta_t *heap_add_block(heap_t *heap, size_t size);
+void coalesce_blocks(heap_t *heap, block_meta_t *block1, block_meta_t *block2);
+void coalesce_attempt(heap_t *heap);
+block_meta_t *search_block_in_list(heap_t *heap, void *ptr);
+block_meta_t *get_free_heap_block(heap_t *heap, size_t size);
+block_meta_t *get_page_aligned_heap_block(heap_t *heap, size_t size);
+block_meta_t *get_last_on_heap(heap_t *heap);
+void trim_heap_attempt(heap_t *heap);
+
+block_meta_t *find_free_block(heap_t *heap, size_t size);
+
+void free_tree_insert(heap_t *heap, block_meta_t *block);
+void free_tree_remove(heap_t *heap, block_meta_t *block);
+block_meta_t *free_tree_best_fit(heap_t *heap, size_t size);
+block_meta_t *free_tree_lowest_fit(heap_t *heap, size_t size);
+
+void free_index_insert(heap_t *heap, block_meta_t *block);
+void free_index_remove(heap_t *heap, block_meta_t *block);
+
+void block_table_destroy(heap_t *heap);
+void block_table_insert(heap_t *heap, block_meta_t *block);
+void block_table_remove(heap_t *heap, block_meta_t *block);
+void block_table_release(heap_t *heap, block_meta_t *block);
+block_meta_t *block_table_best_fit(heap_t *heap, size_t size);
+block_meta_t *block_table_first_fit(heap_t *heap, size_t size);
+block_meta_t *block_table_next_fit(heap_t *heap, size_t size);
+block_meta_t *block_table_good_fit(heap_t *heap, size_t size);
+void block_table_count_pages(heap_t *heap, size_t npages[PURGE_STATES]);
+size_t block_table_purge(heap_t *heap, int from, int to, size_t npages);
+
+void thp_own(uintptr_t start, uintptr_t end, int owned);
+void thp_advise(void *addr, size_t len);
+void *huge_map(size_t size);
+void *thp_map(size_t size);
+int thp_align_heap_start(void);
+void thp_advise_heap(void *heap_end);
+size_t thp_backed_pages(void);
+
+void mapped_insert(heap_t *heap, block_meta_t *block);
+void mapped_remove(heap_t *heap, block_meta_t *block);
+block_meta_t *mapped_lookup(heap_t *heap, void *ptr);
+void mapped_destroy(heap_t *heap);
+
+int start_map_create(heap_t *heap);
+void start_map_destroy(heap_t *heap);
+void start_map_mark(heap_t *heap, block_meta_t *block, int used);
+block_meta_t *start_map_lookup(heap_t *heap, void *ptr);
+
+void *page_block_alloc(size_t size);
+void *page_aligned_alloc(size_t size, int zero);
+int page_block_free(void *ptr);
+int page_block_realloc(void *ptr, size_t size, void **result);
+void *page_block_move(void *ptr, size_t size);
+int page_block_expand(void *ptr, size_t min_size, size_t preferred_size, size_t *result);
+void page_blocks_prefork(void);
+void page_blocks_postfork_parent(void);
+void page_blocks_postfork_child(void);
+
+void release_mapping(void *addr, size_t size);
+void unmap_prefork(void);
+void unmap_postfork_parent(void);
+void unmap_postfork_child(void);
+
+size_t free_block_pages(block_meta_t *block, size_t size, char **start);
+int purge_pages(char *start, size_t npages, int to);
+void decay_thread_start(void);
+void decay_count_pages(size_t npages[PURGE_STATES]);
+void decay_prefork(void);
+void decay_postfork_parent(void);
+void decay_postfork_child(void);
+
+void bulk_zero(void *dest, size_t size);
+void bulk_copy(void *dest, const void *src, size_t size);
+
+int fastbin_push(heap_t *heap, block_meta_t *block);
+block_meta_t *fastbin_pop(heap_t *heap, size_t size);
+void fastbin_consolidate(heap_t *heap);
+
+void *buddy_alloc(size_t size);
+int buddy_free(void *ptr);
+int buddy_realloc(void *ptr, size_t size, void **result);
+int buddy_expand(void *ptr, size_t min_size, size_t preferred_size, size_t *result);
+void buddy_prefork(void);
+void buddy_postfork_parent(void);
+void buddy_postfork_child(void);
+
+void *page_heap_alloc(size_t size, int *clean);
+int page_heap_free(void *ptr);
+int page_heap_realloc(void *ptr, size_t size, void **result);
+int page_heap_expand(void *ptr, size_t min_size, size_t preferred_size, size_t *result);
+void page_heap_count(struct os_stats *dest);
+void page_heap_prefork(void);
+void page_heap_postfork_parent(void);
+void page_heap_postfork_child(void);
+
+void growth_forget(heap_t *heap, block_meta_t *block);
+int growth_realloc(heap_t *heap, block_meta_t *block, size_t size, void **result);
+
+block_meta_t *map_reserve(size_t size);
+int map_reserved(block_meta_t *block);
+int map_reserve_grow(block_meta_t *block, size_t size);
+void map_reserve_shrink(block_meta_t *block, size_t size);
+void map_reserve_release(block_meta_t *block);
+
+void delete_mapped_block(heap_t *heap, block_meta_t *block);
 void copy_block(block_meta_t *dest, block_meta_t *src, size_t size);
-void *shrink_realloc(block_meta_t *block, size_t size);
-void block_coalesce_to_size(block_meta_t *block, size_t size);
-void *extend_realloc(block_meta_t *block, size_t size);
+block_meta_t *realloc_heap_block(heap_t *heap, size_t size);
+void shrink_mapped_block(block_meta_t *block, size_t size);
+int expand_mapped_block(block_meta_t *block, size_t min_size, size_t preferred_size);
+size_t heap_expand(heap_t *heap, void *ptr, size_t min_size, size_t preferred_size);
+void *shrink_realloc(heap_t *heap, block_meta_t *block, size_t size);
+void block_coalesce_to_size(heap_t *heap, block_meta_t *block, size_t size);
+void *extend_realloc(heap_t *heap, block_meta_t *block, size_t size);
+
+void *tcache_get(size_t aligned_size);
+int tcache_put(void *ptr);
+void tcache_prefork(void);
+void tcache_postfork_parent(void);
+void tcache_postfork_child(void);
+
+void *region_chunk_alloc(os_region_t *region, size_t size);
+
+void *heap_malloc(heap_t *heap, size_t size);
+void *heap_calloc(heap_t *heap, size_t size);
+void heap_free(heap_t *heap, void *ptr);
+void *heap_realloc(heap_t *heap, void *ptr, size_t size);
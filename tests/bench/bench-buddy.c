@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Medium size allocation benchmark. The same workloads of blocks from
+ * 4 KiB up to the mmap threshold run on the heap, with best fit, and on
+ * the buddy zone, each in its own child process so both start empty.
+ * For each run, the throughput and the fragmentation are reported, the
+ * latter as the resident memory gained over the peak of live bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "osmem.h"
+
+#define SLOTS		1000
+#define OPERATIONS	200000
+
+struct workload {
+	const char *name;
+	size_t (*size)(unsigned int *seed);
+};
+
+struct backend {
+	const char *name;
+	int buddy;
+};
+
+void *slots[SLOTS];
+size_t sizes[SLOTS];
+
+// Uniformly distributed sizes.
+size_t uniform_size(unsigned int *seed)
+{
+	return 4096 + rand_r(seed) % (120 * 1024);
+}
+
+// Sizes clustered just above powers of two, the worst case of buddies.
+size_t pow2_size(unsigned int *seed)
+{
+	return (4096UL << (rand_r(seed) % 5)) + 64 + rand_r(seed) % 1024;
+}
+
+// Mostly small medium blocks, with a few big ones in between.
+size_t skewed_size(unsigned int *seed)
+{
+	if (rand_r(seed) % 8 == 0)
+		return 32 * 1024 + rand_r(seed) % (88 * 1024);
+
+	return 4096 + rand_r(seed) % 8192;
+}
+
+// Resident set size in bytes, from /proc/self/statm.
+size_t resident_size(void)
+{
+	FILE *file = fopen("/proc/self/statm", "r");
+	unsigned long size = 0, resident = 0;
+
+	if (file) {
+		if (fscanf(file, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(file);
+	}
+
+	return resident * getpagesize();
+}
+
+void run(const struct workload *workload, const struct backend *backend)
+{
+	struct timespec start, end;
+	unsigned int seed = 1;
+	size_t live = 0, peak = 0;
+
+	os_mallopt(OS_M_BUDDY, backend->buddy);
+
+	size_t resident = resident_size();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < OPERATIONS; i++) {
+		int slot = rand_r(&seed) % SLOTS;
+
+		if (slots[slot]) {
+			os_free(slots[slot]);
+			slots[slot] = NULL;
+			live -= sizes[slot];
+			continue;
+		}
+
+		sizes[slot] = workload->size(&seed);
+		slots[slot] = os_malloc(sizes[slot]);
+		memset(slots[slot], 1, sizes[slot]);
+
+		live += sizes[slot];
+		if (live > peak)
+			peak = live;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%-8s %-10s %10.0f ops/s %8.3f resident/peak live\n", workload->name,
+		   backend->name, OPERATIONS / time, (double)(resident_size() - resident) / peak);
+}
+
+int main(void)
+{
+	const struct workload workloads[] = {
+		{ "uniform", uniform_size },
+		{ "pow2", pow2_size },
+		{ "skewed", skewed_size },
+	};
+	const struct backend backends[] = {
+		{ "best-fit", 0 },
+		{ "buddy", 1 },
+	};
+
+	for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+			fflush(stdout);
+
+			pid_t pid = fork();
+
+			if (pid == 0) {
+				run(&workloads[w], &backends[b]);
+				exit(0);
+			}
+
+			waitpid(pid, NULL, 0);
+		}
+	}
+
+	return 0;
+}
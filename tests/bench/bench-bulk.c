@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Large os_calloc() and os_realloc() calls, with the payloads zeroed
+ * and copied through the cache or with non-temporal stores. Between
+ * the calls, the program reads a working set that fits in the cache;
+ * the time of these reads shows how much of it the calls evicted.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "osmem.h"
+
+#define ROUNDS		200
+#define PAYLOAD_SIZE	(8 * 1024 * 1024)
+#define WORKING_SET	(256 * 1024)
+
+volatile char working_set[WORKING_SET];
+
+double elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Reads the working set and adds the time it took to @time.
+ */
+void read_working_set(double *time)
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < WORKING_SET; i += 64)
+		(void)working_set[i];
+
+	*time += elapsed(&start);
+}
+
+void run(const char *name, size_t nt_threshold)
+{
+	struct timespec start;
+	double calloc_time = 0, realloc_time = 0, read_time = 0;
+
+	os_mallopt(OS_M_NT_THRESHOLD, nt_threshold);
+
+	for (int r = 0; r < ROUNDS; r++) {
+		read_working_set(&read_time);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		char *payload = os_calloc(1, PAYLOAD_SIZE);
+
+		calloc_time += elapsed(&start);
+
+		read_working_set(&read_time);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		payload = os_realloc(payload, 2 * PAYLOAD_SIZE);
+		realloc_time += elapsed(&start);
+
+		read_working_set(&read_time);
+		os_free(payload);
+	}
+
+	printf("%-10s calloc %6.2f GB/s, realloc %6.2f GB/s, working set reads %6.3f ms\n",
+		   name, ROUNDS * (double)PAYLOAD_SIZE / calloc_time / 1e9,
+		   ROUNDS * (double)PAYLOAD_SIZE / realloc_time / 1e9,
+		   read_time * 1e3);
+}
+
+int main(void)
+{
+	for (int i = 0; i < WORKING_SET; i++)
+		working_set[i] = i;
+
+	printf("%d rounds of %d MiB payloads, %d KiB working set\n", ROUNDS,
+		   PAYLOAD_SIZE >> 20, WORKING_SET >> 10);
+
+	run("cached", 0);
+	run("streaming", 1024 * 1024);
+
+	return 0;
+}
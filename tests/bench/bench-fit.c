@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Placement policy benchmark. Every policy runs the same workloads,
+ * each in its own child process so all of them start from an empty
+ * heap. For each run, the throughput and the fragmentation are
+ * reported, the latter as the heap size over the peak of live bytes.
+ * Best fit runs on the block list, on the free tree and on the block
+ * table, and address ordered first fit on the free tree, as it otherwise
+ * walks the list exactly as first fit does.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "osmem.h"
+
+#define SLOTS		2000
+#define OPERATIONS	200000
+
+struct workload {
+	const char *name;
+	size_t (*size)(unsigned int *seed, int slot);
+};
+
+struct policy {
+	const char *name;
+	int value;
+	int free_tree;
+	int block_table;
+};
+
+void *slots[SLOTS];
+size_t sizes[SLOTS];
+
+// Uniformly distributed sizes.
+size_t uniform_size(unsigned int *seed, int slot)
+{
+	(void)slot;
+	return 16 + rand_r(seed) % 2048;
+}
+
+// Mostly small objects, with a tenth of the slots holding bigger ones.
+size_t mixed_size(unsigned int *seed, int slot)
+{
+	if (slot % 10 == 0)
+		return 1024 + rand_r(seed) % 8192;
+
+	return 16 + rand_r(seed) % 256;
+}
+
+void run(const struct workload *workload, const struct policy *policy)
+{
+	struct os_stats stats;
+	struct timespec start, end;
+	unsigned int seed = 1;
+	size_t live = 0, peak = 0;
+
+	os_mallopt(OS_M_STATS, 1);
+	os_mallopt(OS_M_FIT_POLICY, policy->value);
+	os_mallopt(OS_M_FREE_TREE, policy->free_tree);
+	os_mallopt(OS_M_BLOCK_TABLE, policy->block_table);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < OPERATIONS; i++) {
+		int slot = rand_r(&seed) % SLOTS;
+
+		if (slots[slot]) {
+			os_free(slots[slot]);
+			slots[slot] = NULL;
+			live -= sizes[slot];
+			continue;
+		}
+
+		sizes[slot] = workload->size(&seed, slot);
+		slots[slot] = os_malloc(sizes[slot]);
+		memset(slots[slot], 1, sizes[slot]);
+
+		live += sizes[slot];
+		if (live > peak)
+			peak = live;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	os_stats_get(&stats);
+
+	printf("%-8s %-10s %10.0f ops/s %8.3f heap/peak live\n", workload->name,
+		   policy->name, OPERATIONS / time, (double)stats.heap_size / peak);
+}
+
+int main(void)
+{
+	const struct workload workloads[] = {
+		{ "uniform", uniform_size },
+		{ "mixed", mixed_size },
+	};
+	const struct policy policies[] = {
+		{ "best", OS_FIT_BEST, 0, 0 },
+		{ "best-tree", OS_FIT_BEST, 1, 0 },
+		{ "best-table", OS_FIT_BEST, 0, 1 },
+		{ "first", OS_FIT_FIRST, 0, 0 },
+		{ "next", OS_FIT_NEXT, 0, 0 },
+		{ "address", OS_FIT_ADDRESS, 1, 0 },
+		{ "good", OS_FIT_GOOD, 0, 0 },
+	};
+
+	for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+			fflush(stdout);
+
+			pid_t pid = fork();
+
+			if (pid == 0) {
+				run(&workloads[w], &policies[p]);
+				exit(0);
+			}
+
+			waitpid(pid, NULL, 0);
+		}
+	}
+
+	return 0;
+}
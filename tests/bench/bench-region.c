@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Request-style benchmark: each request allocates a few hundred small
+ * objects that all die when it ends. The objects are either allocated
+ * and freed one by one or taken from a region that is reset after
+ * every request.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "osmem.h"
+
+#define REQUESTS	20000
+#define OBJECTS		300
+
+void *objects[OBJECTS];
+
+double elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double run_malloc(void)
+{
+	struct timespec start;
+	unsigned int seed = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int r = 0; r < REQUESTS; r++) {
+		for (int i = 0; i < OBJECTS; i++) {
+			objects[i] = os_malloc(16 + rand_r(&seed) % 240);
+			*(char *)objects[i] = 1;
+		}
+
+		for (int i = 0; i < OBJECTS; i++)
+			os_free(objects[i]);
+	}
+
+	return elapsed(&start);
+}
+
+double run_region(void)
+{
+	struct timespec start;
+	unsigned int seed = 1;
+	os_region_t *region = os_region_create(0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int r = 0; r < REQUESTS; r++) {
+		for (int i = 0; i < OBJECTS; i++) {
+			objects[i] = os_region_alloc(region, 16 + rand_r(&seed) % 240);
+			*(char *)objects[i] = 1;
+		}
+
+		os_region_reset(region);
+	}
+
+	double time = elapsed(&start);
+
+	os_region_destroy(region);
+	return time;
+}
+
+int main(void)
+{
+	double malloc_time = run_malloc();
+	double region_time = run_region();
+
+	printf("%d requests, %d objects each\n", REQUESTS, OBJECTS);
+	printf("os_malloc/os_free: %.3f s, %.0f objects/s\n", malloc_time,
+		   (double)REQUESTS * OBJECTS / malloc_time);
+	printf("region:            %.3f s, %.0f objects/s\n", region_time,
+		   (double)REQUESTS * OBJECTS / region_time);
+
+	return 0;
+}
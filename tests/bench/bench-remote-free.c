@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Producer/consumer benchmark for cross-thread frees. Each producer
+ * allocates small objects and hands them to its consumer through a ring,
+ * the consumer frees them. Every thread has its own arena, so all frees
+ * are remote. The run is repeated with the remote free queues disabled,
+ * when the consumer takes the producer's arena lock for every free.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include "osmem.h"
+
+#define PAIRS		4
+#define OBJECTS		200000
+#define RING_SIZE	1024
+
+struct ring {
+	void *slots[RING_SIZE];
+	atomic_size_t head;
+	atomic_size_t tail;
+};
+
+struct ring rings[PAIRS];
+
+void *producer(void *arg)
+{
+	struct ring *ring = arg;
+	unsigned int seed = (unsigned int)(ring - rings);
+
+	for (size_t i = 0; i < OBJECTS; i++) {
+		size_t size = 16 + rand_r(&seed) % 240;
+		char *ptr = os_malloc(size);
+
+		ptr[0] = 1;
+
+		size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+		while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE)
+			sched_yield();
+
+		ring->slots[head % RING_SIZE] = ptr;
+		atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	}
+
+	return NULL;
+}
+
+void *consumer(void *arg)
+{
+	struct ring *ring = arg;
+
+	// Bind the consumer to its own arena before the first free.
+	os_free(os_malloc(16));
+
+	for (size_t i = 0; i < OBJECTS; i++) {
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+		while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+			sched_yield();
+
+		os_free(ring->slots[tail % RING_SIZE]);
+		atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	}
+
+	return NULL;
+}
+
+double run(void)
+{
+	pthread_t threads[2 * PAIRS];
+	struct timespec start, end;
+
+	for (int i = 0; i < PAIRS; i++) {
+		atomic_store(&rings[i].head, 0);
+		atomic_store(&rings[i].tail, 0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < PAIRS; i++) {
+		pthread_create(&threads[2 * i], NULL, producer, &rings[i]);
+		pthread_create(&threads[2 * i + 1], NULL, consumer, &rings[i]);
+	}
+
+	for (int i = 0; i < 2 * PAIRS; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(void)
+{
+	double locked, remote;
+
+	// One arena per thread of each run, plus the main thread.
+	os_mallopt(OS_M_ARENA_COUNT, 4 * PAIRS + 1);
+	os_free(os_malloc(16));
+
+	os_mallopt(OS_M_REMOTE_FREE, 0);
+	locked = run();
+
+	os_mallopt(OS_M_REMOTE_FREE, 1);
+	remote = run();
+
+	printf("%d producer/consumer pairs, %d objects each\n", PAIRS, OBJECTS);
+	printf("owner lock:        %.3f s, %.0f frees/s\n", locked, PAIRS * OBJECTS / locked);
+	printf("remote free queue: %.3f s, %.0f frees/s\n", remote, PAIRS * OBJECTS / remote);
+
+	return 0;
+}
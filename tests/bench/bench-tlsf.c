@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Worst-case latency test for real-time pools. Each workload is run on
+ * a TLSF pool and on os_malloc()/os_free(), and the cycles of every
+ * single operation are measured. The maximum is what a real-time
+ * thread has to budget for; the mean is given for reference.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "osmem.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES()	__rdtsc()
+#define CYCLE_UNIT	"cycles"
+#else
+#define CYCLES()	now_ns()
+#define CYCLE_UNIT	"ns"
+#endif
+
+#define SLOTS		4096
+#define OPERATIONS	200000
+#define POOL_SIZE	(64 * 1024 * 1024)
+
+struct latency {
+	uint64_t max;
+	uint64_t total;
+	uint64_t count;
+};
+
+struct engine {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+};
+
+struct workload {
+	const char *name;
+	void (*run)(struct engine *engine, struct latency *alloc, struct latency *release);
+};
+
+void *slots[SLOTS];
+os_tlsf_t *pool;
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void *pool_malloc(size_t size)
+{
+	return os_tlsf_malloc(pool, size);
+}
+
+void pool_free(void *ptr)
+{
+	os_tlsf_free(pool, ptr);
+}
+
+void record(struct latency *latency, uint64_t cycles)
+{
+	if (cycles > latency->max)
+		latency->max = cycles;
+
+	latency->total += cycles;
+	latency->count++;
+}
+
+void *timed_malloc(struct engine *engine, struct latency *latency, size_t size)
+{
+	uint64_t start = CYCLES();
+	void *ptr = engine->malloc(size);
+
+	record(latency, CYCLES() - start);
+
+	if (ptr)
+		*(char *)ptr = 1;
+	return ptr;
+}
+
+void timed_free(struct engine *engine, struct latency *latency, void *ptr)
+{
+	uint64_t start = CYCLES();
+
+	engine->free(ptr);
+	record(latency, CYCLES() - start);
+}
+
+void release_all(struct engine *engine, struct latency *release)
+{
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i])
+			timed_free(engine, release, slots[i]);
+		slots[i] = NULL;
+	}
+}
+
+// Random sizes from 16 bytes to 16 KiB, freed in random order.
+void run_random(struct engine *engine, struct latency *alloc, struct latency *release)
+{
+	unsigned int seed = 1;
+
+	for (int op = 0; op < OPERATIONS; op++) {
+		int slot = rand_r(&seed) % SLOTS;
+
+		if (slots[slot]) {
+			timed_free(engine, release, slots[slot]);
+			slots[slot] = NULL;
+		} else {
+			slots[slot] = timed_malloc(engine, alloc, 16 + rand_r(&seed) % 16384);
+		}
+	}
+
+	release_all(engine, release);
+}
+
+/*
+ * Small blocks with every other one freed, so the free space is split
+ * in holes too small for the bigger requests that follow.
+ */
+void run_holes(struct engine *engine, struct latency *alloc, struct latency *release)
+{
+	for (int round = 0; round < OPERATIONS / SLOTS; round++) {
+		for (int i = 0; i < SLOTS; i++)
+			slots[i] = timed_malloc(engine, alloc, 32);
+
+		for (int i = 0; i < SLOTS; i += 2) {
+			timed_free(engine, release, slots[i]);
+			slots[i] = NULL;
+		}
+
+		for (int i = 0; i < SLOTS; i += 2)
+			slots[i] = timed_malloc(engine, alloc, 48 + round % 64);
+
+		release_all(engine, release);
+	}
+}
+
+// Tiny and large requests alternating, each large one freed right away.
+void run_mixed(struct engine *engine, struct latency *alloc, struct latency *release)
+{
+	for (int op = 0; op < OPERATIONS / 2; op++) {
+		int slot = op % SLOTS;
+
+		if (slots[slot])
+			timed_free(engine, release, slots[slot]);
+		slots[slot] = timed_malloc(engine, alloc, 16);
+
+		void *large = timed_malloc(engine, alloc, 64 * 1024 + op % 4096);
+
+		timed_free(engine, release, large);
+	}
+
+	release_all(engine, release);
+}
+
+struct workload workloads[] = {
+	{ "random", run_random },
+	{ "holes", run_holes },
+	{ "mixed", run_mixed },
+};
+
+struct engine engines[] = {
+	{ "tlsf", pool_malloc, pool_free },
+	{ "os_malloc", os_malloc, os_free },
+};
+
+int main(void)
+{
+	pool = os_tlsf_create(POOL_SIZE);
+	if (!pool)
+		return 1;
+
+	printf("%-8s %-10s %12s %12s %12s %12s   (%s)\n", "workload", "engine",
+		   "malloc max", "malloc mean", "free max", "free mean", CYCLE_UNIT);
+
+	for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+			struct latency alloc = { 0 }, release = { 0 };
+
+			workloads[w].run(&engines[e], &alloc, &release);
+
+			printf("%-8s %-10s %12lu %12lu %12lu %12lu\n", workloads[w].name,
+				   engines[e].name, (unsigned long)alloc.max,
+				   (unsigned long)(alloc.total / alloc.count),
+				   (unsigned long)release.max,
+				   (unsigned long)(release.total / release.count));
+		}
+	}
+
+	os_tlsf_destroy(pool);
+	return 0;
+}
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * The huge pages of the page heap are mapped at random addresses, so the
+ * placement of the filler is checked here rather than traced against a
+ * reference.
+ */
+
+#include "test-utils.h"
+
+#define PAGE_SIZE	(4 * MULT_KB)
+#define HUGE_PAGE_SIZE	(512 * PAGE_SIZE)
+#define NUM_SMALL	8
+#define SMALL_SIZE	(HUGE_PAGE_SIZE / NUM_SMALL)
+#define LARGE_SIZE	(384 * PAGE_SIZE)
+#define REQUEST_SIZE	(50 * PAGE_SIZE)
+
+int main(void)
+{
+	char *small[NUM_SMALL], *large, *ptr, *rest;
+	struct os_stats stats;
+
+	os_mallopt(OS_M_PAGE_HEAP, 1);
+	os_mallopt(OS_M_HUGEPAGE_FILLER, 1);
+	os_mallopt(OS_M_STATS, 1);
+
+	/* Fill a first huge page, then use most of a second one */
+	for (int i = 0; i < NUM_SMALL; i++)
+		small[i] = os_malloc_checked(SMALL_SIZE);
+	large = os_malloc_checked(LARGE_SIZE);
+
+	/* The first huge page is left half used, in smaller free spans */
+	for (int i = 1; i < NUM_SMALL; i += 2)
+		os_free(small[i]);
+
+	/* Packed into the fullest huge page, not the best fitting span */
+	ptr = os_malloc_checked(REQUEST_SIZE);
+	FAIL(ptr != large + LARGE_SIZE, "DBG: span not packed into the fullest huge page");
+
+	/* Only the rest of the second huge page is big enough, and fills it */
+	rest = os_malloc_checked(HUGE_PAGE_SIZE - LARGE_SIZE - REQUEST_SIZE);
+	FAIL(rest != ptr + REQUEST_SIZE, "DBG: span not carved from the free pages left");
+
+	memset(&stats, 0, sizeof(stats));
+	os_stats_get(&stats);
+	FAIL(stats.huge_pages != 2, "DBG: page heap did not map two huge pages");
+	FAIL(stats.huge_pages_full != 1, "DBG: filled huge page not counted as full");
+
+	/* Once all freed, both are free as a whole */
+	for (int i = 0; i < NUM_SMALL; i += 2)
+		os_free(small[i]);
+	os_free(large);
+	os_free(ptr);
+	os_free(rest);
+
+	memset(&stats, 0, sizeof(stats));
+	os_stats_get(&stats);
+	FAIL(stats.huge_pages_free != 2, "DBG: free huge pages not counted as free");
+
+	return 0;
+}
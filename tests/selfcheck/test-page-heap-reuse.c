@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Spans are carved from chunks mapped at a random huge page boundary, so
+ * their addresses differ between runs and are checked here rather than
+ * traced against a reference.
+ */
+
+#include "test-utils.h"
+
+#define SPAN_SIZE	(50 * 4 * MULT_KB)
+
+size_t count_mmap(void)
+{
+	struct os_stats stats;
+
+	os_stats_get(&stats);
+	return stats.nmmap;
+}
+
+int main(void)
+{
+	char *ptr, *next;
+	size_t nmmap;
+
+	os_mallopt(OS_M_PAGE_HEAP, 1);
+	os_mallopt(OS_M_STATS, 1);
+
+	/* Spans start on a page, with no header */
+	ptr = os_malloc_checked(SPAN_SIZE);
+	FAIL((size_t)ptr % getpagesize(), "DBG: span not page aligned");
+	nmmap = count_mmap();
+
+	/* Freed pages are merged and reused for any size */
+	os_free(ptr);
+	FAIL(os_malloc_checked(inc_sz_lg[1]) != ptr, "DBG: free span not reused");
+
+	/* Grown in place with the free pages after it, spans have no header to check */
+	FAIL(os_realloc(ptr, inc_sz_lg[2]) != ptr, "DBG: span not grown in place");
+	os_free(ptr);
+
+	/* Spans are carved one after the other */
+	ptr = os_malloc_checked(SPAN_SIZE);
+	next = os_malloc_checked(SPAN_SIZE);
+	FAIL(next != ptr + SPAN_SIZE, "DBG: spans not carved from the same pages");
+	os_free(next);
+	os_free(ptr);
+
+	FAIL(count_mmap() != nmmap, "DBG: page heap mapped memory it had");
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include "test-utils.h"
+
+void *main_ptr;
+
+void *worker(void *arg)
+{
+	void *ptr;
+
+	(void)arg;
+
+	/* The second thread to allocate is bound to its own arena */
+	ptr = os_malloc_checked(inc_sz_sm[3]);
+	FAIL(((struct block_meta *)ptr - 1)->arena != 1, "DBG: second thread did not get an arena");
+	os_free(ptr);
+
+	/* A block of the main heap is queued for it, not freed here */
+	os_free(main_ptr);
+	FAIL(((struct block_meta *)main_ptr - 1)->status != STATUS_ALLOC, "DBG: remote block freed unlocked");
+
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t thread;
+	struct os_stats stats;
+	void *ptr;
+
+	os_mallopt(OS_M_ARENA_COUNT, 2);
+	os_mallopt(OS_M_STATS, 1);
+
+	/* The first thread to allocate gets the main heap */
+	main_ptr = os_malloc_checked(inc_sz_sm[3]);
+
+	/* Calls of other threads are not traced */
+	DIE(pthread_create(&thread, NULL, worker, NULL) != 0, "pthread_create");
+	DIE(pthread_join(thread, NULL) != 0, "pthread_join");
+
+	os_stats_get(&stats);
+	FAIL(stats.nremote_free != 1, "DBG: remote free not queued");
+
+	/* The main heap drains its queue on the next call and reuses the block */
+	ptr = os_malloc_checked(inc_sz_sm[3]);
+	FAIL(ptr != main_ptr, "DBG: remotely freed block not reused");
+
+	/* Cleanup */
+	os_free(ptr);
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define NUM_BLOCKS	6
+#define BLOCK_SIZE	64
+#define MERGED_SIZE	(3 * BLOCK_SIZE + 2 * METADATA_SIZE)
+
+int main(void)
+{
+	void *ptrs[NUM_BLOCKS];
+	struct block_meta *first_meta;
+
+	os_mallopt(OS_M_BLOCK_TABLE, 1);
+
+	/* The table of free blocks is mapped apart from the heap, traced above */
+	for (int i = 0; i < NUM_BLOCKS; i++)
+		ptrs[i] = os_malloc_checked(BLOCK_SIZE);
+	first_meta = (struct block_meta *)ptrs[0] - 1;
+
+	/* Freed blocks are merged with their free neighbours right away */
+	os_free(ptrs[0]);
+	os_free(ptrs[2]);
+	os_free(ptrs[1]);
+	FAIL(first_meta->status != STATUS_FREE, "DBG: freed block not free");
+	FAIL(first_meta->size != MERGED_SIZE, "DBG: freed neighbours not merged");
+
+	/* Best fit over the table: the block of the same size, not the lowest */
+	os_free(ptrs[4]);
+	FAIL(os_malloc_checked(BLOCK_SIZE) != ptrs[4], "DBG: best fitting block not used");
+
+	/* The merged block serves a request none of its parts could */
+	FAIL(os_malloc_checked(MERGED_SIZE) != ptrs[0], "DBG: merged block not reused");
+
+	/* Cleanup */
+	os_free(ptrs[0]);
+	for (int i = 3; i < NUM_BLOCKS; i++)
+		os_free(ptrs[i]);
+
+	return 0;
+}
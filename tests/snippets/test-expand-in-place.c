@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define HEAP_GROWN_SIZE	(127 * MULT_KB)
+#define MAPPED_GROWN_SIZE	((size_t)inc_sz_lg[0] + 2 * MULT_KB)
+
+int main(void)
+{
+	void *ptr, *next, *big;
+	size_t size;
+
+	ptr = os_malloc_checked(inc_sz_sm[3]);
+	next = os_malloc_checked(inc_sz_sm[3]);
+	os_free(next);
+
+	/* Grows into the free blocks after it, with no syscall */
+	size = os_expand(ptr, inc_sz_sm[8], inc_sz_sm[9]);
+	FAIL(size != (size_t)inc_sz_sm[9], "DBG: os_expand did not take the preferred size");
+	FAIL(os_realloc_checked(ptr, inc_sz_sm[9]) != ptr, "DBG: os_expand did not resize the block");
+
+	/* A used block after it: left unchanged */
+	next = os_malloc_checked(inc_sz_sm[3]);
+	FAIL(os_expand(ptr, inc_sz_sm[10], inc_sz_sm[10]) != 0, "DBG: os_expand overwrote the next block");
+	FAIL(((struct block_meta *)ptr - 1)->size != (size_t)inc_sz_sm[9], "DBG: os_expand changed the block");
+
+	/* The last block takes the rest of the heap, then extends it with brk */
+	size = os_expand(next, HEAP_GROWN_SIZE, HEAP_GROWN_SIZE);
+	FAIL(size != HEAP_GROWN_SIZE, "DBG: os_expand did not grow the last block");
+
+	/* Mapped blocks use the rest of their last page, with no syscall */
+	big = os_malloc_checked(inc_sz_lg[0]);
+	size = os_expand(big, MAPPED_GROWN_SIZE, MAPPED_GROWN_SIZE);
+	FAIL(size != MAPPED_GROWN_SIZE, "DBG: os_expand did not grow the mapped block");
+
+	/* Cleanup */
+	os_free(big);
+	os_free(next);
+	os_free(ptr);
+
+	return 0;
+}
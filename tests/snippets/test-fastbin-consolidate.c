@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define FAST_SIZE	40
+#define MERGED_SIZE	(2 * FAST_SIZE + METADATA_SIZE)
+#define CONSOLIDATE_SIZE	MULT_KB
+
+int main(void)
+{
+	void *ptr, *first, *second, *guard, *big;
+	struct block_meta *first_meta, *second_meta;
+
+	os_mallopt(OS_M_FASTBINS, 1);
+
+	ptr = os_malloc_checked(inc_sz_sm[0]);
+	first = os_malloc_checked(FAST_SIZE);
+	second = os_malloc_checked(FAST_SIZE);
+	guard = os_malloc_checked(FAST_SIZE);
+	first_meta = (struct block_meta *)first - 1;
+	second_meta = (struct block_meta *)second - 1;
+
+	/* Small blocks are kept in their bin, neither freed nor merged */
+	os_free(first);
+	os_free(second);
+	FAIL(first_meta->status != STATUS_FASTBIN, "DBG: small block not kept in a fastbin");
+	FAIL(second_meta->status != STATUS_FASTBIN, "DBG: small block not kept in a fastbin");
+	FAIL(first_meta->size != FAST_SIZE, "DBG: fastbin block merged on free");
+
+	/* The last one freed comes back first */
+	FAIL(os_malloc_checked(FAST_SIZE) != second, "DBG: fastbin block not reused");
+	os_free(second);
+
+	/* A large request releases the bins, merging the neighbours */
+	big = os_malloc_checked(CONSOLIDATE_SIZE);
+	FAIL(first_meta->status != STATUS_FREE, "DBG: fastbins not consolidated");
+	FAIL(first_meta->size != MERGED_SIZE, "DBG: consolidated blocks not merged");
+
+	/* So the merged block serves a request neither bin could */
+	FAIL(os_malloc_checked(MERGED_SIZE) != first, "DBG: merged block not reused");
+
+	/* Cleanup */
+	os_free(first);
+	os_free(big);
+	os_free(guard);
+	os_free(ptr);
+
+	return 0;
+}
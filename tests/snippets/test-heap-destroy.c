@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+int main(void)
+{
+	os_heap_t *heap;
+	void *ptr, *heap_ptr, *block, *reused;
+
+	heap_ptr = os_malloc_checked(inc_sz_sm[0]);
+
+	/* The heap reserves its own range, mapped in the trace above */
+	heap = os_heap_create();
+	FAIL(heap == NULL, "DBG: os_heap_create returned NULL");
+
+	/* Its blocks are reused like those of the main heap */
+	block = os_heap_malloc(heap, inc_sz_sm[4]);
+	FAIL(block == NULL, "DBG: os_heap_malloc returned NULL on valid size");
+	os_heap_free(heap, block);
+	reused = os_heap_malloc(heap, inc_sz_sm[4]);
+	FAIL(reused != block, "DBG: os_heap_malloc did not reuse a free block");
+	os_heap_free(heap, reused);
+
+	/* ... but never handed out by os_malloc() */
+	ptr = os_malloc_checked(inc_sz_sm[4]);
+	FAIL(ptr == block, "DBG: os_malloc returned a block of another heap");
+
+	/* Big blocks are mapped on their own, the mmap is traced above */
+	block = os_heap_malloc(heap, inc_sz_lg[0]);
+	FAIL(block == NULL, "DBG: os_heap_malloc returned NULL on valid size");
+
+	for (int i = 0; i < NUM_SZ_SM; i++)
+		FAIL(os_heap_malloc(heap, inc_sz_sm[i]) == NULL, "DBG: os_heap_malloc returned NULL");
+
+	/* Destroyed with its blocks: the mapped one, then the whole range */
+	os_heap_destroy(heap);
+
+	/* Cleanup */
+	os_free(ptr);
+	os_free(heap_ptr);
+
+	return 0;
+}
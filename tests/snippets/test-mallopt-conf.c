@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+extern char **environ;
+
+int main(void)
+{
+	void *ptr, *small_ptr;
+	char *conf_env[] = {"OSMEM_CONF=prealloc:64k,mmap_threshold:4k", NULL};
+
+	/*
+	 * Read on the first call: a smaller heap and mmap threshold. The
+	 * environment is replaced as a whole, as setenv() would move the
+	 * program break with malloc().
+	 */
+	environ = conf_env;
+
+	small_ptr = os_malloc_checked(inc_sz_sm[0]);
+
+	/* Mapped, as it is above the threshold set in the environment */
+	ptr = os_malloc_checked(inc_sz_md[0]);
+	os_free(ptr);
+
+	/* Raised at run time, the same size fits the preallocated heap */
+	FAIL(!os_mallopt(OS_M_MMAP_THRESHOLD, MMAP_THRESHOLD), "DBG: os_mallopt rejected a threshold");
+	ptr = os_malloc_checked(inc_sz_md[0]);
+	os_free(ptr);
+
+	/* Invalid values are rejected and change nothing */
+	FAIL(os_mallopt(OS_M_MMAP_THRESHOLD, 0), "DBG: os_mallopt accepted a null threshold");
+	FAIL(os_mallopt(OS_M_ALIGNMENT, 4 * MULT_KB), "DBG: os_mallopt changed the alignment");
+	FAIL(os_mallopt(OS_M_TCACHE_SIZE, 64 * MULT_KB), "DBG: os_mallopt accepted an oversized tcache");
+	FAIL(os_mallopt(-1, 0), "DBG: os_mallopt accepted an unknown parameter");
+
+	ptr = os_malloc_checked(inc_sz_md[0]);
+
+	/* Cleanup */
+	os_free(ptr);
+	os_free(small_ptr);
+
+	return 0;
+}
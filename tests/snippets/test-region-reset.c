@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define CHUNK_SIZE	MULT_KB
+#define OBJ_SIZE	100
+#define OBJ_STEP	104
+
+int main(void)
+{
+	os_region_t *region;
+	char *first, *ptr, *big;
+	void *heap_ptr;
+
+	heap_ptr = os_malloc_checked(inc_sz_sm[0]);
+
+	/* Objects are carved one after the other, with no header */
+	region = os_region_create(CHUNK_SIZE);
+	FAIL(region == NULL, "DBG: os_region_create returned NULL");
+	first = os_region_alloc(region, OBJ_SIZE);
+	ptr = os_region_alloc(region, OBJ_SIZE);
+	FAIL(ptr != first + OBJ_STEP, "DBG: region object not bumped after the previous one");
+
+	/* Bigger than a chunk: a chunk of its own, the current one is kept */
+	big = os_region_alloc(region, 4 * CHUNK_SIZE);
+	ptr = os_region_alloc(region, OBJ_SIZE);
+	FAIL(ptr != first + 2 * OBJ_STEP, "DBG: region chunk dropped after an oversized object");
+
+	/* Fill the first chunk, then take a second one */
+	while (ptr < first + CHUNK_SIZE - OBJ_STEP)
+		ptr = os_region_alloc(region, OBJ_SIZE);
+	ptr = os_region_alloc(region, OBJ_SIZE);
+	FAIL(ptr < big, "DBG: region reused its full chunk");
+
+	/* A reset gives back every chunk but the first and starts over */
+	os_region_reset(region);
+	ptr = os_region_alloc(region, OBJ_SIZE);
+	FAIL(ptr != first, "DBG: region reset did not rewind its first chunk");
+
+	/* The oversized chunk, just before its object, is free again */
+	ptr = os_malloc_checked(4 * CHUNK_SIZE);
+	FAIL(ptr > big || ptr + OBJ_STEP < big, "DBG: region chunk not given back to the heap");
+
+	/* Cleanup */
+	os_free(ptr);
+	os_region_destroy(region);
+	os_free(heap_ptr);
+
+	return 0;
+}
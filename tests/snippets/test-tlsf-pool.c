@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+#define POOL_SIZE	(16 * MULT_KB)
+#define OBJ_SIZE	100
+#define OBJ_STEP	128
+#define MERGED_SIZE	(2 * OBJ_STEP - 16)
+
+int main(void)
+{
+	os_tlsf_t *pool;
+	char *first, *second, *third;
+	void *ptr, *heap_ptr;
+
+	ptr = os_malloc_checked(inc_sz_sm[0]);
+
+	/* The whole pool is mapped once, in the trace above */
+	pool = os_tlsf_create(POOL_SIZE);
+	FAIL(pool == NULL, "DBG: os_tlsf_create returned NULL");
+
+	/* Any syscall of the pool would show under this call */
+	heap_ptr = os_malloc_checked(inc_sz_sm[3]);
+
+	/* Blocks are carved one after the other */
+	first = os_tlsf_malloc(pool, OBJ_SIZE);
+	second = os_tlsf_malloc(pool, OBJ_SIZE);
+	third = os_tlsf_malloc(pool, OBJ_SIZE);
+	FAIL(first == NULL, "DBG: os_tlsf_malloc returned NULL on valid size");
+	FAIL(second != first + OBJ_STEP, "DBG: pool block not split from the free one");
+	FAIL(third != second + OBJ_STEP, "DBG: pool block not split from the free one");
+
+	/* Freed neighbours are merged at once */
+	os_tlsf_free(pool, first);
+	os_tlsf_free(pool, second);
+	FAIL(os_tlsf_malloc(pool, MERGED_SIZE) != first, "DBG: free pool blocks not merged");
+
+	/* A pool never grows */
+	FAIL(os_tlsf_malloc(pool, 2 * POOL_SIZE) != NULL, "DBG: os_tlsf_malloc overflowed the pool");
+
+	/* Once all freed, the pool is whole again */
+	os_tlsf_free(pool, first);
+	os_tlsf_free(pool, third);
+	FAIL(os_tlsf_malloc(pool, POOL_SIZE / 2) != first, "DBG: pool not merged back whole");
+
+	os_free(heap_ptr);
+
+	/* Unmapped at once, in the trace above */
+	os_tlsf_destroy(pool);
+
+	/* Cleanup */
+	os_free(ptr);
+
+	return 0;
+}
@@ -19,6 +19,8 @@
 struct block_meta {
 	size_t size;
 	int status;
+	unsigned short arena;
+	unsigned short purge;
 	struct block_meta *prev;
 	struct block_meta *next;
 };
@@ -27,3 +29,4 @@ struct block_meta {
 #define STATUS_FREE   0
 #define STATUS_ALLOC  1
 #define STATUS_MAPPED 2
+#define STATUS_FASTBIN 3
@@ -11,3 +11,98 @@ void *os_malloc(size_t size);
 void os_free(void *ptr);
 void *os_calloc(size_t nmemb, size_t size);
 void *os_realloc(void *ptr, size_t size);
+size_t os_expand(void *ptr, size_t min_size, size_t preferred_size);
+
+/* Parameters accepted by os_mallopt() */
+#define OS_M_PREALLOC_SIZE	1
+#define OS_M_MMAP_THRESHOLD	2
+#define OS_M_TRIM_THRESHOLD	3
+#define OS_M_ALIGNMENT		4
+#define OS_M_ARENA_COUNT	5
+#define OS_M_TCACHE_SIZE	6
+#define OS_M_DIRTY_DECAY_MS	7
+#define OS_M_MUZZY_DECAY_MS	8
+#define OS_M_STATS		9
+#define OS_M_THP		10
+#define OS_M_REMOTE_FREE	11
+#define OS_M_PERCPU		12
+#define OS_M_VM_HEAP		13
+#define OS_M_FREE_TREE		14
+#define OS_M_FIT_POLICY		15
+#define OS_M_START_MAP		16
+#define OS_M_PAGE_ALIGN		17
+#define OS_M_ASYNC_MUNMAP	18
+#define OS_M_BACKGROUND_THREAD	19
+#define OS_M_NT_THRESHOLD	20
+#define OS_M_MMAP_HYSTERESIS	21
+#define OS_M_GROW_STREAK	22
+#define OS_M_MAP_HEADROOM	23
+#define OS_M_FASTBINS		24
+#define OS_M_BUDDY		25
+#define OS_M_PAGE_HEAP		26
+#define OS_M_HUGEPAGE_FILLER	27
+#define OS_M_BLOCK_TABLE	28
+
+/* Placement policies for OS_M_FIT_POLICY */
+#define OS_FIT_BEST		0
+#define OS_FIT_FIRST		1
+#define OS_FIT_NEXT		2
+#define OS_FIT_ADDRESS		3
+#define OS_FIT_GOOD		4
+
+int os_mallopt(int param, long value);
+
+/* Allocator statistics, filled in by os_stats_get() */
+struct os_stats {
+	size_t heap_size;
+	size_t mapped_size;
+	size_t trimmed_size;
+	size_t nmalloc;
+	size_t ncalloc;
+	size_t nrealloc;
+	size_t nfree;
+	size_t nsbrk;
+	size_t nmmap;
+	size_t nmunmap;
+	size_t thp_hinted;
+	size_t thp_backed;
+	size_t nremote_free;
+	size_t ncache_hit;
+	size_t npurged;
+	size_t dirty_pages;
+	size_t muzzy_pages;
+	size_t clean_pages;
+	size_t ngrow_reserve;
+	size_t nfastbin_hit;
+	size_t huge_pages;
+	size_t huge_pages_full;
+	size_t huge_pages_free;
+	size_t span_pages;
+};
+
+void os_stats_get(struct os_stats *stats);
+
+/* Bump allocation regions, released as a whole */
+typedef struct os_region os_region_t;
+
+os_region_t *os_region_create(size_t chunk_size);
+void *os_region_alloc(os_region_t *region, size_t size);
+void os_region_reset(os_region_t *region);
+void os_region_destroy(os_region_t *region);
+
+/* Independent heaps, destroyed with all their blocks at once */
+typedef struct heap os_heap_t;
+
+os_heap_t *os_heap_create(void);
+void *os_heap_malloc(os_heap_t *heap, size_t size);
+void os_heap_free(os_heap_t *heap, void *ptr);
+void *os_heap_realloc(os_heap_t *heap, void *ptr, size_t size);
+void os_heap_destroy(os_heap_t *heap);
+
+/* Real-time pools, with constant time allocation and free */
+typedef struct os_tlsf os_tlsf_t;
+
+os_tlsf_t *os_tlsf_create(size_t size);
+void *os_tlsf_malloc(os_tlsf_t *pool, size_t size);
+void os_tlsf_free(os_tlsf_t *pool, void *ptr);
+void os_tlsf_destroy(os_tlsf_t *pool);